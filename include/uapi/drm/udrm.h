@@ -21,6 +21,9 @@ extern "C" {
 #endif
 
 #define UDRM_MAX_NAME_SIZE    80
+#define UDRM_MAX_QUEUE_DEPTH  64
+#define UDRM_MAX_BUFS         4
+#define UDRM_MAX_CLIPS        16
 
 /* FIXME: Update Documentation/ioctl/ioctl-number.txt */
 #define UDRM_IOCTL_BASE       0xB5
@@ -29,8 +32,80 @@ extern "C" {
 #define UDRM_BUF_MODE_PLAIN_COPY	1
 #define UDRM_BUF_MODE_SWAP_BYTES	2
 
+/*
+ * Packed grayscale for e-paper and monochrome panels, any advertised format
+ * is converted. Each clip row starts on a byte boundary and is
+ * DIV_ROUND_UP(width * bpp, 8) bytes, the leftmost pixel in the most
+ * significant bits. 0 is black. Clips are widened to whole bytes.
+ * Without a DITHER flag the gray level is rounded to the nearest value.
+ * Ordered dithering uses an 8x8 Bayer matrix anchored to the framebuffer
+ * origin so partial updates line up. Error diffusion is Floyd-Steinberg
+ * within each clip.
+ */
+#define UDRM_BUF_MODE_GRAY8		3
+#define UDRM_BUF_MODE_GRAY4		4
+#define UDRM_BUF_MODE_GRAY2		5
+#define UDRM_BUF_MODE_MONO		6
+
+/*
+ * No transfer buffer, userspace reads the framebuffers directly through
+ * the dma-buf fd in UDRM_EVENT_FB_CREATE and the dirty events only carry
+ * clips. The fd is installed by read(), so this can't be combined with
+ * UDRM_DEV_FLAG_RING. Imported framebuffers need DMA_BUF_IOCTL_SYNC around
+ * the reads, the others are write-combined.
+ */
+#define UDRM_BUF_MODE_ZERO_COPY		7
+
+#define UDRM_BUF_MODE_MASK		0xff
+
 #define UDRM_BUF_MODE_EMUL_XRGB8888	BIT(8)
 
+/*
+ * formats[0] is the native format of the display and the transfer buffer
+ * always holds that format, the other advertised formats are converted.
+ * RGB565, BGR565, RGB888, BGR888, XRGB8888 and XBGR8888 can be native,
+ * and ARGB8888/ABGR8888 can also be converted from, dropping alpha.
+ * SWAP_BYTES reverses the bytes of each native pixel.
+ */
+#define UDRM_BUF_MODE_EMULATE		BIT(9)
+
+#define UDRM_BUF_MODE_DITHER_ORDERED	BIT(10)
+#define UDRM_BUF_MODE_DITHER_DIFFUSION	BIT(11)
+
+/*
+ * Compress the transfer buffer for slow links. The clips are packed as
+ * usual and the whole stream is run length encoded in pixel units, one
+ * byte for the grayscale modes. A header byte h is followed by
+ * (h & 0x7f) + 1 literal pixels, or by one pixel repeated
+ * (h & 0x7f) + 1 times if h & 0x80. With ROW_DELTA each clip row is
+ * first XORed with the row above it in the same clip, so the decoder
+ * XORs each decoded row with the previous decoded one. A flush that
+ * doesn't get smaller is sent raw, see buf_encoding.
+ */
+#define UDRM_BUF_MODE_RLE		BIT(12)
+#define UDRM_BUF_MODE_ROW_DELTA		BIT(13)
+
+#define UDRM_DEV_FLAG_RING		(1 << 0)
+#define UDRM_DEV_FLAG_ASYNC_DIRTY	(1 << 1)
+#define UDRM_DEV_FLAG_COPY_FILL		(1 << 2)
+#define UDRM_DEV_FLAG_TILE_HASH		(1 << 3)
+
+/*
+ * Flushes run on a workqueue of the device's own, so a slow userspace driver
+ * only holds up its own display. HIGHPRI makes it a high priority
+ * workqueue, CPU runs the flushes on @cpu, next to the userspace driver.
+ */
+#define UDRM_DEV_FLAG_HIGHPRI		(1 << 4)
+#define UDRM_DEV_FLAG_CPU		(1 << 5)
+
+/*
+ * Keep the DRM device when /dev/udrm is closed, so the display survives a
+ * restart of the userspace driver. The next one picks it up with
+ * UDRM_DEV_ATTACH. Events are dropped while nobody is attached. Attaching
+ * without this flag makes the device go away on close as usual.
+ */
+#define UDRM_DEV_FLAG_PERSIST		(1 << 6)
+
 struct udrm_dev_create {
 	char name[UDRM_MAX_NAME_SIZE];
 	struct drm_mode_modeinfo mode;
@@ -38,15 +113,105 @@ struct udrm_dev_create {
 	__u32 num_formats;
 	__u32 buf_mode;
 	__s32 buf_fd;
+	__u32 queue_depth;
+	__u32 flags;
+	__u32 max_clips;
+	__u32 clip_cost;
+	__u32 num_bufs;
+	__s32 buf_fds[UDRM_MAX_BUFS];
+	__u32 cpu;
 
 	__u32 index;
+	__u32 ring_size;
 };
 
 #define UDRM_DEV_CREATE       _IOWR(UDRM_IOCTL_BASE, 1, struct udrm_dev_create)
+#define UDRM_RING_COMPLETE    _IO(UDRM_IOCTL_BASE, 2)
+#define UDRM_BUF_RELEASE      _IOW(UDRM_IOCTL_BASE, 3, __u32)
+
+/*
+ * Attach to a persistent device that has no userspace driver, by @name or by
+ * the DRM minor @index if @name is empty. @flags can be UDRM_DEV_FLAG_RING
+ * and UDRM_DEV_FLAG_PERSIST, the other settings are kept from
+ * UDRM_DEV_CREATE and returned. The transfer buffers are returned as new
+ * fds in buf_fds.
+ *
+ * The current state is then replayed: UDRM_EVENT_FB_CREATE for every
+ * framebuffer, UDRM_EVENT_PIPE_ENABLE if the pipe is enabled and a full
+ * flush of the scanout framebuffer. A framebuffer created during the replay
+ * can be announced twice.
+ */
+struct udrm_dev_attach {
+	char name[UDRM_MAX_NAME_SIZE];
+	__u32 index;
+	__u32 flags;
+
+	__u32 buf_mode;
+	__u32 queue_depth;
+	__u32 max_clips;
+	__u32 num_bufs;
+	__s32 buf_fds[UDRM_MAX_BUFS];
+	__u32 ring_size;
+};
+
+#define UDRM_DEV_ATTACH       _IOWR(UDRM_IOCTL_BASE, 4, struct udrm_dev_attach)
+
+/*
+ * Shared memory event ring, enabled with UDRM_DEV_FLAG_RING and mapped with
+ * mmap() on /dev/udrm at offset 0 (ring_size bytes) after UDRM_DEV_CREATE.
+ *
+ * The kernel puts events in the submission queue (sq), one per
+ * sq_entry_size slot, and userspace puts struct udrm_event_reply entries in
+ * the completion queue (cq). Head and tail indices are free running and are
+ * masked with num_entries - 1. Each side only writes the tail of the queue
+ * it produces and the head of the queue it consumes.
+ *
+ * poll() reaps the completion queue and waits for events. It only needs to
+ * be called when the submission queue is empty. UDRM_RING_COMPLETE reaps the
+ * completion queue without waiting.
+ */
+struct udrm_ring {
+	__u32 sq_head;
+	__u32 sq_tail;
+	__u32 cq_head;
+	__u32 cq_tail;
+	__u32 num_entries;
+	__u32 sq_entry_size;
+	__u32 sq_offset;
+	__u32 cq_offset;
+};
+
+#define UDRM_RING_SQ_ENTRY_SIZE	512
 
 struct udrm_event {
 	__u32 type;
 	__u32 length;
+	__u32 seq;
+	__u32 pad;
+};
+
+#define UDRM_REPLY_TIMESTAMP	(1 << 0)
+#define UDRM_REPLY_BUF_RETAIN	(1 << 1)
+
+/*
+ * Written to /dev/udrm to complete the event with sequence number @seq.
+ * Several replies can be written in one go and in any order.
+ *
+ * With UDRM_REPLY_TIMESTAMP set in @flags, a reply to UDRM_EVENT_FB_DIRTY
+ * carries the CLOCK_MONOTONIC time in @timestamp_ns when the frame reached
+ * the display. It is passed on in the page flip event of the flush.
+ *
+ * With UDRM_REPLY_BUF_RETAIN set, userspace keeps the transfer buffer of an
+ * UDRM_EVENT_FB_DIRTY after replying, and gives it back with
+ * UDRM_BUF_RELEASE when it's done reading it. Releasing a buffer that isn't
+ * retained fails with -EINVAL.
+ */
+struct udrm_event_reply {
+	__u32 seq;
+	__s32 ret;
+	__u32 flags;
+	__u32 pad;
+	__u64 timestamp_ns;
 };
 
 #define UDRM_EVENT_PIPE_ENABLE	1
@@ -55,19 +220,59 @@ struct udrm_event {
 #define UDRM_EVENT_FB_CREATE	3
 #define UDRM_EVENT_FB_DESTROY	4
 
+/*
+ * buf_fd is only valid in UDRM_EVENT_FB_CREATE with UDRM_BUF_MODE_ZERO_COPY
+ * and is -1 otherwise. Userspace owns it and should close it on
+ * UDRM_EVENT_FB_DESTROY.
+ */
 struct udrm_event_fb {
 	struct udrm_event base;
 	__u32 fb_id;
+	__s32 buf_fd;
+	__u32 width;
+	__u32 height;
+	__u32 pitch;
+	__u32 format;
 };
 
 #define UDRM_EVENT_FB_DIRTY 	5
 
+/*
+ * At most max_clips rectangles are sent. Two rectangles are merged into
+ * their bounding box when that adds fewer than clip_cost pixels, so
+ * clip_cost is the per-rectangle setup overhead expressed in pixels.
+ * With a transfer buffer the clips are packed one after the other, each
+ * with a pitch of its own width.
+ *
+ * The transfer buffers are the num_bufs buffers in buf_fds, or buf_fd if
+ * num_bufs is zero. A flush owns buf_index until the reply (or
+ * UDRM_BUF_RELEASE), so the next flush can fill another buffer while
+ * userspace is still sending this one. buf_age is the number of flushes
+ * since this buffer was last used, zero the first time. buf_len is the
+ * number of bytes written to the buffer and buf_encoding is
+ * UDRM_BUF_MODE_RLE, UDRM_BUF_MODE_ROW_DELTA or zero if it's raw.
+ */
 struct udrm_event_fb_dirty {
 	struct udrm_event base;
 	struct drm_mode_fb_dirty_cmd fb_dirty_cmd;
+	__u32 buf_index;
+	__u32 buf_age;
+	__u32 buf_len;
+	__u32 buf_encoding;
 	struct drm_clip_rect clips[];
 };
 
+/*
+ * Sent instead of a flush when the userspace driver has set
+ * UDRM_DEV_FLAG_COPY_FILL, using struct udrm_event_fb_dirty.
+ * FB_COPY: the clips are src/dst pairs of equal size, the display should
+ *          move the pixels in src to dst (DRM_MODE_FB_DIRTY_ANNOTATE_COPY).
+ * FB_FILL: the clips should be filled with color, which is a pixel value
+ *          in the framebuffer format (DRM_MODE_FB_DIRTY_ANNOTATE_FILL).
+ */
+#define UDRM_EVENT_FB_COPY	6
+#define UDRM_EVENT_FB_FILL	7
+
 #define UDRM_PRIME_HANDLE_TO_FD 0x01
 #define DRM_IOCTL_UDRM_PRIME_HANDLE_TO_FD    DRM_IOWR(DRM_COMMAND_BASE + UDRM_PRIME_HANDLE_TO_FD, struct drm_prime_handle)
 
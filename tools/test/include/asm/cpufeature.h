@@ -0,0 +1,3 @@
+#define boot_cpu_has(feature)	(feature)
+#define X86_FEATURE_XMM2	__builtin_cpu_supports("sse2")
+#define X86_FEATURE_XMM4_1	__builtin_cpu_supports("sse4.1")
@@ -0,0 +1,3 @@
+/* Userspace owns its FPU state */
+#define kernel_fpu_begin()	do { } while (0)
+#define kernel_fpu_end()	do { } while (0)
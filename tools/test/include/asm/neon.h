@@ -0,0 +1,3 @@
+#define kernel_neon_begin()	do { } while (0)
+#define kernel_neon_end()	do { } while (0)
+#define cpu_has_neon()		1
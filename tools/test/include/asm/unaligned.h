@@ -0,0 +1,6 @@
+/* Like the kernel's packed struct accessors */
+#define get_unaligned(p) ({						\
+	const struct { __typeof__(*(p)) v; } __attribute__((packed)) *_p = \
+		(const void *)(p);					\
+	_p->v;								\
+})
@@ -0,0 +1,105 @@
+/*
+ * Just enough of the kernel and DRM for udrm-clip.c and udrm-conv.c to
+ * build in userspace. The structures embedded in struct udrm_device are
+ * placeholders, nothing here touches them.
+ */
+
+#ifndef _UDRM_TEST_DRMP_H
+#define _UDRM_TEST_DRMP_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <drm/drm_mode.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef s64 ktime_t;
+
+#define S64_MAX		INT64_MAX
+#define BIT(n)		(1UL << (n))
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define __aligned(x)	__attribute__((aligned(x)))
+#define __percpu
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b)	({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); \
+			   _a < _b ? _a : _b; })
+#define max(a, b)	({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); \
+			   _a > _b ? _a : _b; })
+#define min_t(t, a, b)	min((t)(a), (t)(b))
+#define max_t(t, a, b)	max((t)(a), (t)(b))
+#define clamp(v, lo, hi) min(max(v, lo), hi)
+#define swap(a, b)	do { __typeof__(a) _t = (a); (a) = (b); (b) = _t; } \
+			while (0)
+
+#define DRM_DEBUG_KMS(fmt, ...)		do { } while (0)
+#define DRM_DEBUG_DRIVER(fmt, ...)	do { } while (0)
+
+struct list_head { struct list_head *next, *prev; };
+struct work_struct { struct list_head entry; void (*func)(struct work_struct *); };
+struct delayed_work { struct work_struct work; };
+struct mutex { long owner; };
+struct idr { void *root; };
+struct hrtimer { ktime_t expires; };
+typedef struct { int counter; } atomic_t;
+typedef struct { int lock; } spinlock_t;
+typedef struct { spinlock_t lock; struct list_head head; } wait_queue_head_t;
+
+struct drm_device { void *dev_private; };
+struct drm_driver { const char *name; };
+struct drm_display_mode { int hdisplay, vdisplay; };
+struct drm_connector { int status; };
+struct drm_simple_display_pipe { void *funcs; };
+struct drm_gem_cma_object { void *vaddr; };
+
+struct dma_buf;
+struct dentry;
+struct drm_crtc;
+struct drm_file;
+struct drm_framebuffer;
+struct drm_minor;
+struct drm_pending_vblank_event;
+
+#define fourcc_code(a, b, c, d)	((u32)(a) | ((u32)(b) << 8) | \
+				 ((u32)(c) << 16) | ((u32)(d) << 24))
+
+#define DRM_FORMAT_RGB565	fourcc_code('R', 'G', '1', '6')
+#define DRM_FORMAT_BGR565	fourcc_code('B', 'G', '1', '6')
+#define DRM_FORMAT_RGB888	fourcc_code('R', 'G', '2', '4')
+#define DRM_FORMAT_BGR888	fourcc_code('B', 'G', '2', '4')
+#define DRM_FORMAT_XRGB8888	fourcc_code('X', 'R', '2', '4')
+#define DRM_FORMAT_XBGR8888	fourcc_code('X', 'B', '2', '4')
+#define DRM_FORMAT_ARGB8888	fourcc_code('A', 'R', '2', '4')
+#define DRM_FORMAT_ABGR8888	fourcc_code('A', 'B', '2', '4')
+
+static inline int drm_format_plane_cpp(u32 format, int plane)
+{
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_BGR565:
+		return 2;
+	case DRM_FORMAT_RGB888:
+	case DRM_FORMAT_BGR888:
+		return 3;
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_ABGR8888:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+#endif
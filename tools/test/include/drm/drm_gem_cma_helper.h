@@ -0,0 +1 @@
+#include <drm/drmP.h>
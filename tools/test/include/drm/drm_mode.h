@@ -0,0 +1,53 @@
+/* The parts of the DRM uapi that include/uapi/drm/udrm.h uses */
+
+#ifndef _UDRM_TEST_DRM_MODE_H
+#define _UDRM_TEST_DRM_MODE_H
+
+#include <linux/types.h>
+
+#define DRM_IOCTL_BASE			'd'
+#define DRM_IOWR(nr, type)		_IOWR(DRM_IOCTL_BASE, nr, type)
+#define DRM_COMMAND_BASE		0x40
+
+#define DRM_DISPLAY_MODE_LEN		32
+
+#define DRM_MODE_FB_DIRTY_ANNOTATE_COPY	0x01
+#define DRM_MODE_FB_DIRTY_ANNOTATE_FILL	0x02
+
+struct drm_clip_rect {
+	unsigned short x1;
+	unsigned short y1;
+	unsigned short x2;
+	unsigned short y2;
+};
+
+struct drm_mode_modeinfo {
+	__u32 clock;
+	__u16 hdisplay;
+	__u16 hsync_start;
+	__u16 hsync_end;
+	__u16 htotal;
+	__u16 hskew;
+	__u16 vdisplay;
+	__u16 vsync_start;
+	__u16 vsync_end;
+	__u16 vtotal;
+	__u16 vscan;
+	__u32 vrefresh;
+	__u32 flags;
+	__u32 type;
+	char name[DRM_DISPLAY_MODE_LEN];
+};
+
+struct drm_mode_fb_dirty_cmd {
+	__u32 fb_id;
+	__u32 flags;
+	__u32 color;
+	__u32 num_clips;
+	__u64 clips_ptr;
+};
+
+struct drm_mode_fb_cmd2;
+struct drm_prime_handle;
+
+#endif
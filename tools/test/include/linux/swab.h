@@ -0,0 +1,2 @@
+#define swab16(x)	__builtin_bswap16(x)
+#define swab32(x)	__builtin_bswap32(x)
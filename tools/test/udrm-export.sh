@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Zero-copy framebuffer export. The userspace driver closes the dma-buf fd
+# of every framebuffer as soon as it gets it, then the framebuffers are
+# flushed, destroyed and created again, and exported again to a driver
+# that attached to the persistent device after they were created. Closing the fd must not drop a reference on the GEM object
+# that the export never took, which shows up as a refcount or KASAN splat.
+# Needs root and the udrm module, output is TAP.
+
+FRAMES=${FRAMES:-120}
+
+cd "$(dirname "$0")/.." || exit 1
+
+if [ "$(id -u)" != 0 ] || [ ! -c /dev/udrm ]; then
+	echo "1..0 # SKIP needs root and the udrm module"
+	exit 4
+fi
+if [ ! -x ./udrm-ref ] || [ ! -x ./udrm-load ]; then
+	echo "1..0 # SKIP build the tools first"
+	exit 4
+fi
+
+tmp=$(mktemp -d) || exit 1
+ref=
+trap 'kill $ref 2>/dev/null; rm -rf "$tmp"' EXIT
+
+num=0
+ret=0
+
+result()
+{
+	num=$((num + 1))
+	if [ "$1" = 0 ]; then
+		echo "ok $num $2"
+	else
+		echo "not ok $num $2"
+		ret=1
+	fi
+}
+
+start_ref()
+{
+	./udrm-ref -n udrm-export -m zero -k "$@" > "$tmp/ref" &
+	ref=$!
+	card=
+	for t in $(seq 50); do
+		card=$(awk '/^card/ { print $2 }' "$tmp/ref")
+		[ -n "$card" ] && break
+		sleep 0.1
+	done
+	# Let fbdev emulation set itself up first
+	sleep 1
+}
+
+stop_ref()
+{
+	kill $ref
+	wait $ref 2>/dev/null
+	ref=
+}
+
+echo "1..4"
+echo "udrm-export.sh: start" > /dev/kmsg
+
+# Persistent, so the fbcon framebuffer outlives the driver
+start_ref -x 0x40
+[ -n "$card" ]
+result $? "device created"
+
+# Each run creates its framebuffers, flushes and destroys them
+./udrm-load -c "$card" -n "$FRAMES" -d rect > /dev/null &&
+	./udrm-load -c "$card" -n "$FRAMES" -d full -p > /dev/null
+result $? "flush after the dma-buf fd is closed"
+
+# The replay on attach exports the fbcon framebuffer again. Without
+# -x 0x40 the device goes away when this driver stops.
+stop_ref
+start_ref -a
+./udrm-load -c "$card" -n "$FRAMES" -d lines > /dev/null
+result $? "flush after the framebuffers are exported again"
+stop_ref
+
+dmesg | sed -n '/udrm-export.sh: start/,$p' > "$tmp/dmesg"
+! grep -E 'BUG|WARNING|refcount|use-after-free' "$tmp/dmesg"
+result $? "no kernel warnings"
+
+exit $ret
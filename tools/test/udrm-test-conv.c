@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * udrm-conv.c is included so the static row functions can be reached.
+ * On x86 this file is built with -mgeneral-regs-only: like the kernel, the
+ * compiler must not touch the xmm registers the SSE code keeps its masks in.
+ */
+
+#include "../../udrm-conv.c"
+
+#include "udrm-test.h"
+
+/* Index 0 is the scalar reference */
+static const struct udrm_conv_funcs *const udrm_test_convs[] = {
+	&udrm_conv_scalar,
+#ifdef CONFIG_X86
+	&udrm_conv_sse2,
+	&udrm_conv_sse41,
+#endif
+#ifdef CONFIG_KERNEL_MODE_NEON
+	&udrm_conv_neon,
+#endif
+};
+
+unsigned int udrm_test_num_convs(void)
+{
+	return ARRAY_SIZE(udrm_test_convs);
+}
+
+const char *udrm_test_conv_name(unsigned int i)
+{
+	return udrm_test_convs[i]->name;
+}
+
+bool udrm_test_conv_usable(unsigned int i)
+{
+#ifdef CONFIG_X86
+	if (udrm_test_convs[i] == &udrm_conv_sse2)
+		return boot_cpu_has(X86_FEATURE_XMM2);
+	if (udrm_test_convs[i] == &udrm_conv_sse41)
+		return boot_cpu_has(X86_FEATURE_XMM4_1);
+#endif
+	return true;
+}
+
+/* Called the way the clip loops call them */
+void udrm_test_conv_rgb565(unsigned int i, u16 *dst, const u32 *src,
+			   unsigned int len, bool swap)
+{
+	const struct udrm_conv_funcs *conv = udrm_test_convs[i];
+
+	if (conv->begin)
+		conv->begin();
+	conv->rgb565(dst, src, len, swap);
+	if (conv->end)
+		conv->end();
+}
+
+void udrm_test_conv_swab16(unsigned int i, u16 *dst, const u16 *src,
+			   unsigned int len)
+{
+	const struct udrm_conv_funcs *conv = udrm_test_convs[i];
+
+	if (conv->begin)
+		conv->begin();
+	conv->swap16(dst, src, len);
+	if (conv->end)
+		conv->end();
+}
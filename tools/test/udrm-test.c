@@ -0,0 +1,639 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Tests for the damage clip helpers in udrm-clip.c and the pixel conversion
+ * in udrm-conv.c, run in userspace against the stub headers in include/.
+ * The output is TAP like kselftest. With -b the SIMD row functions are
+ * also timed against the scalar ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <drm/drmP.h>
+#include <linux/swab.h>
+
+#include <uapi/drm/udrm.h>
+
+#include "../../udrm.h"
+#include "udrm-test.h"
+
+static bool failed;
+
+#define EXPECT(cond) do {						\
+	if (!(cond)) {							\
+		printf("# %s:%d: %s\n", __func__, __LINE__, #cond);	\
+		failed = true;						\
+	}								\
+} while (0)
+
+#define RECT(a, b, c, d)	((struct drm_clip_rect){ a, b, c, d })
+
+static u32 rand_state = 1;
+
+/* xorshift32, so runs are reproducible */
+static u32 test_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+static void fill_rand(void *buf, size_t len)
+{
+	u8 *p = buf;
+
+	while (len--)
+		*p++ = test_rand();
+}
+
+static bool rect_eq(const struct drm_clip_rect *a,
+		    const struct drm_clip_rect *b)
+{
+	return a->x1 == b->x1 && a->y1 == b->y1 &&
+	       a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+static bool rect_contains(const struct drm_clip_rect *outer,
+			  const struct drm_clip_rect *inner)
+{
+	return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+	       outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+/* Every rectangle in @in must be covered by one in @out */
+static bool rects_covered(const struct drm_clip_rect *out, unsigned int n_out,
+			  const struct drm_clip_rect *in, unsigned int n_in)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < n_in; i++) {
+		for (j = 0; j < n_out; j++)
+			if (rect_contains(&out[j], &in[i]))
+				break;
+		if (j == n_out)
+			return false;
+	}
+
+	return true;
+}
+
+static void test_clip_add_separate(void)
+{
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS + 1];
+	unsigned int n = 0;
+
+	udrm_clip_add(clips, &n, 4, 0, &RECT(0, 0, 10, 10));
+	udrm_clip_add(clips, &n, 4, 0, &RECT(100, 100, 110, 110));
+	EXPECT(n == 2);
+	EXPECT(rect_eq(&clips[0], &RECT(0, 0, 10, 10)));
+	EXPECT(rect_eq(&clips[1], &RECT(100, 100, 110, 110)));
+}
+
+static void test_clip_add_merge_cost(void)
+{
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS + 1];
+	unsigned int n = 0;
+
+	/* Touching rectangles cost nothing to merge */
+	udrm_clip_add(clips, &n, 4, 0, &RECT(0, 0, 10, 10));
+	udrm_clip_add(clips, &n, 4, 0, &RECT(10, 0, 20, 10));
+	EXPECT(n == 1);
+	EXPECT(rect_eq(&clips[0], &RECT(0, 0, 20, 10)));
+
+	/* A gap of 100 pixels is merged at clip_cost 100, not at 99 */
+	n = 0;
+	udrm_clip_add(clips, &n, 4, 0, &RECT(0, 0, 10, 10));
+	udrm_clip_add(clips, &n, 4, 0, &RECT(30, 0, 40, 10));
+	udrm_clip_add(clips, &n, 4, 99, &RECT(50, 0, 60, 10));
+	EXPECT(n == 3);
+
+	n = 0;
+	udrm_clip_add(clips, &n, 4, 0, &RECT(0, 0, 10, 10));
+	udrm_clip_add(clips, &n, 4, 0, &RECT(30, 0, 40, 10));
+	udrm_clip_add(clips, &n, 4, 100, &RECT(50, 0, 60, 10));
+	EXPECT(n == 2);
+	EXPECT(rect_eq(&clips[0], &RECT(0, 0, 10, 10)));
+	EXPECT(rect_eq(&clips[1], &RECT(30, 0, 60, 10)));
+}
+
+static void test_clip_add_chain(void)
+{
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS + 1];
+	unsigned int n = 0;
+
+	/* The bridge merges with one side, then the union with the other */
+	udrm_clip_add(clips, &n, 4, 0, &RECT(0, 0, 10, 10));
+	udrm_clip_add(clips, &n, 4, 0, &RECT(20, 0, 30, 10));
+	EXPECT(n == 2);
+	udrm_clip_add(clips, &n, 4, 0, &RECT(10, 0, 20, 10));
+	EXPECT(n == 1);
+	EXPECT(rect_eq(&clips[0], &RECT(0, 0, 30, 10)));
+}
+
+static void test_clip_add_overflow(void)
+{
+	const struct drm_clip_rect in[] = {
+		RECT(0, 0, 10, 10),
+		RECT(200, 200, 210, 210),
+		RECT(12, 0, 22, 10),
+	};
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS + 1];
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(in); i++)
+		udrm_clip_add(clips, &n, 2, 0, &in[i]);
+
+	/* The cheapest pair is merged */
+	EXPECT(n == 2);
+	EXPECT(rect_eq(&clips[0], &RECT(0, 0, 22, 10)));
+	EXPECT(rect_eq(&clips[1], &RECT(200, 200, 210, 210)));
+	EXPECT(rects_covered(clips, n, in, ARRAY_SIZE(in)));
+}
+
+static void test_merge_clips_full(void)
+{
+	struct drm_clip_rect dst[UDRM_MAX_CLIPS + 1];
+	struct drm_clip_rect src[1] = { RECT(1, 1, 2, 2) };
+
+	EXPECT(udrm_merge_clips(dst, 4, 0, NULL, 0, 0, 320, 240) == 1);
+	EXPECT(rect_eq(&dst[0], &RECT(0, 0, 320, 240)));
+
+	memset(dst, 0, sizeof(dst));
+	EXPECT(udrm_merge_clips(dst, 4, 0, src, 0, 0, 320, 240) == 1);
+	EXPECT(rect_eq(&dst[0], &RECT(0, 0, 320, 240)));
+}
+
+static void test_merge_clips_invalid(void)
+{
+	static const struct drm_clip_rect invalid[] = {
+		RECT(0, 0, 321, 10),	/* past the right edge */
+		RECT(0, 0, 10, 241),	/* past the bottom edge */
+		RECT(10, 0, 10, 10),	/* empty */
+		RECT(0, 20, 10, 10),	/* upside down */
+	};
+	struct drm_clip_rect dst[UDRM_MAX_CLIPS + 1];
+	struct drm_clip_rect src[2];
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+		src[0] = RECT(5, 5, 15, 15);
+		src[1] = invalid[i];
+		EXPECT(udrm_merge_clips(dst, 4, 0, src, 2, 0, 320, 240) == 1);
+		EXPECT(rect_eq(&dst[0], &RECT(0, 0, 320, 240)));
+	}
+
+	/* The right and bottom edges themselves are fine */
+	src[0] = RECT(310, 230, 320, 240);
+	EXPECT(udrm_merge_clips(dst, 4, 0, src, 1, 0, 320, 240) == 1);
+	EXPECT(rect_eq(&dst[0], &src[0]));
+}
+
+static void test_merge_clips_copy(void)
+{
+	struct drm_clip_rect dst[UDRM_MAX_CLIPS + 1];
+	struct drm_clip_rect src[] = {
+		RECT(0, 0, 10, 10),		/* copy 1 source */
+		RECT(50, 50, 60, 60),		/* copy 1 destination */
+		RECT(100, 0, 110, 10),		/* copy 2 source */
+		RECT(200, 200, 210, 210),	/* copy 2 destination */
+	};
+	unsigned int n;
+
+	/* Only the destinations are damaged */
+	n = udrm_merge_clips(dst, 4, 0, src, 4,
+			     DRM_MODE_FB_DIRTY_ANNOTATE_COPY, 320, 240);
+	EXPECT(n == 2);
+	EXPECT(rect_eq(&dst[0], &src[1]));
+	EXPECT(rect_eq(&dst[1], &src[3]));
+
+	/*
+	 * An odd count only has one complete pair. Nothing past it may be
+	 * read, the invalid rectangles would turn this into a full flush.
+	 */
+	src[2] = RECT(400, 400, 0, 0);
+	src[3] = RECT(400, 400, 0, 0);
+	n = udrm_merge_clips(dst, 4, 0, src, 3,
+			     DRM_MODE_FB_DIRTY_ANNOTATE_COPY, 320, 240);
+	EXPECT(n == 1);
+	EXPECT(rect_eq(&dst[0], &src[1]));
+}
+
+static void test_merge_clips_overflow(void)
+{
+	struct drm_clip_rect dst[UDRM_MAX_CLIPS + 1];
+	struct drm_clip_rect src[UDRM_MAX_CLIPS * 2];
+	unsigned int i, max_clips, n;
+
+	/* A grid of small rectangles far enough apart never to be cheap */
+	for (i = 0; i < ARRAY_SIZE(src); i++)
+		src[i] = RECT((i % 8) * 40, (i / 8) * 40,
+			      (i % 8) * 40 + 4, (i / 8) * 40 + 4);
+
+	for (max_clips = 1; max_clips <= UDRM_MAX_CLIPS; max_clips++) {
+		memset(dst, 0, sizeof(dst));
+		n = udrm_merge_clips(dst, max_clips, 0, src, ARRAY_SIZE(src),
+				     0, 320, 240);
+		EXPECT(n == max_clips);
+		EXPECT(rects_covered(dst, n, src, ARRAY_SIZE(src)));
+		for (i = 0; i < n; i++)
+			EXPECT(udrm_clip_valid(&dst[i], 320, 240));
+	}
+}
+
+static u16 ref_rgb565(u32 v, bool bgr)
+{
+	u16 r = (v >> 19) & 0x1f, g = (v >> 10) & 0x3f, b = (v >> 3) & 0x1f;
+
+	return bgr ? (b << 11) | (g << 5) | r : (r << 11) | (g << 5) | b;
+}
+
+static void test_conv_rgb565_golden(void)
+{
+	static const u32 src[] = {
+		0x00ff0000, 0x0000ff00, 0x000000ff, 0xff123456,
+		0x00ffffff, 0x00070307, 0x00080408, 0x00000000,
+		0x00ff0000,
+	};
+	static const u16 golden[] = {
+		0xf800, 0x07e0, 0x001f, 0x11aa,
+		0xffff, 0x0000, 0x0821, 0x0000,
+		0xf800,
+	};
+	u16 dst[ARRAY_SIZE(src)];
+	unsigned int i, j;
+
+	for (i = 0; i < udrm_test_num_convs(); i++) {
+		if (!udrm_test_conv_usable(i))
+			continue;
+
+		udrm_test_conv_rgb565(i, dst, src, ARRAY_SIZE(src), false);
+		for (j = 0; j < ARRAY_SIZE(src); j++)
+			EXPECT(dst[j] == golden[j]);
+
+		udrm_test_conv_rgb565(i, dst, src, ARRAY_SIZE(src), true);
+		for (j = 0; j < ARRAY_SIZE(src); j++)
+			EXPECT(dst[j] == swab16(golden[j]));
+	}
+}
+
+/* The SIMD rows against the scalar ones, every length and alignment */
+static void test_conv_simd_exact(void)
+{
+	u32 src32[256 + 4];
+	u16 src16[256 + 8], ref[256], dst[256 + 1];
+	unsigned int i, len, off, swap;
+
+	fill_rand(src32, sizeof(src32));
+	fill_rand(src16, sizeof(src16));
+
+	for (i = 1; i < udrm_test_num_convs(); i++) {
+		if (!udrm_test_conv_usable(i)) {
+			printf("# %s not supported by this CPU\n",
+			       udrm_test_conv_name(i));
+			continue;
+		}
+
+		for (len = 0; len <= 256; len += len < 40 ? 1 : 27) {
+			for (off = 0; off < 4; off++) {
+				for (swap = 0; swap < 2; swap++) {
+					udrm_test_conv_rgb565(0, ref,
+							      src32 + off,
+							      len, swap);
+					dst[len] = 0xdead;
+					udrm_test_conv_rgb565(i, dst,
+							      src32 + off,
+							      len, swap);
+					EXPECT(!memcmp(dst, ref,
+						       len * sizeof(*ref)));
+					EXPECT(dst[len] == 0xdead);
+				}
+			}
+
+			for (off = 0; off < 8; off++) {
+				udrm_test_conv_swab16(0, ref, src16 + off, len);
+				dst[len] = 0xdead;
+				udrm_test_conv_swab16(i, dst, src16 + off, len);
+				EXPECT(!memcmp(dst, ref, len * sizeof(*ref)));
+				EXPECT(dst[len] == 0xdead);
+			}
+		}
+	}
+}
+
+/* Pack @v in @format the way the formats are laid out in memory */
+static unsigned int ref_pack(u8 *p, u32 v, u32 format)
+{
+	u16 v16;
+
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_BGR565:
+		v16 = ref_rgb565(v, format == DRM_FORMAT_BGR565);
+		p[0] = v16;
+		p[1] = v16 >> 8;
+		return 2;
+	case DRM_FORMAT_RGB888:
+		p[0] = v;
+		p[1] = v >> 8;
+		p[2] = v >> 16;
+		return 3;
+	case DRM_FORMAT_BGR888:
+		p[0] = v >> 16;
+		p[1] = v >> 8;
+		p[2] = v;
+		return 3;
+	case DRM_FORMAT_XRGB8888:
+		p[0] = v;
+		p[1] = v >> 8;
+		p[2] = v >> 16;
+		p[3] = v >> 24;
+		return 4;
+	case DRM_FORMAT_XBGR8888:
+		p[0] = v >> 16;
+		p[1] = v >> 8;
+		p[2] = v;
+		p[3] = 0;
+		return 4;
+	}
+
+	return 0;
+}
+
+static void ref_swap(u8 *p, unsigned int cpp)
+{
+	unsigned int i;
+	u8 t;
+
+	for (i = 0; i < cpp / 2; i++) {
+		t = p[i];
+		p[i] = p[cpp - 1 - i];
+		p[cpp - 1 - i] = t;
+	}
+}
+
+/* An unaligned clip of an odd sized XRGB8888 framebuffer, every format */
+static void test_conv_clip_formats(void)
+{
+	static const u32 formats[] = {
+		DRM_FORMAT_RGB565, DRM_FORMAT_BGR565,
+		DRM_FORMAT_RGB888, DRM_FORMAT_BGR888,
+		DRM_FORMAT_XRGB8888, DRM_FORMAT_XBGR8888,
+	};
+	const unsigned int height = 9, pitch = 61 * 4 + 12;
+	const struct drm_clip_rect clip = RECT(3, 2, 40, 7);
+	u8 fb[pitch * height], dst[37 * 5 * 4], ref[37 * 5 * 4];
+	unsigned int i, x, y, cpp, swap, wc;
+	u8 *p;
+	u32 v;
+
+	fill_rand(fb, sizeof(fb));
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		for (swap = 0; swap < 2; swap++) {
+			p = ref;
+			for (y = clip.y1; y < clip.y2; y++) {
+				for (x = clip.x1; x < clip.x2; x++) {
+					memcpy(&v, &fb[y * pitch + x * 4], 4);
+					cpp = ref_pack(p, v, formats[i]);
+					if (swap)
+						ref_swap(p, cpp);
+					p += cpp;
+				}
+			}
+
+			for (wc = 0; wc < 2; wc++) {
+				memset(dst, 0, sizeof(dst));
+				EXPECT(!udrm_conv_clip(dst, fb, pitch, &clip,
+						       DRM_FORMAT_XRGB8888,
+						       formats[i], swap, wc));
+				EXPECT(!memcmp(dst, ref, p - ref));
+			}
+		}
+	}
+
+	EXPECT(udrm_conv_clip(dst, fb, pitch, &clip, DRM_FORMAT_XRGB8888,
+			      DRM_FORMAT_ARGB8888, false, false) == -EINVAL);
+}
+
+/* Grayscale without dithering, rows start on a byte boundary */
+static void test_conv_clip_gray(void)
+{
+	static const unsigned int bpps[] = { 8, 4, 2, 1 };
+	const unsigned int pitch = 29 * 4;
+	const struct drm_clip_rect clip = RECT(8, 1, 29, 6);
+	u8 fb[29 * 4 * 6], dst[128], ref[128];
+	unsigned int i, x, y, g, q, bpp, shift, max;
+	u32 line[29], v;
+	s16 err[2 * (29 + 2)];
+	u8 *p;
+
+	fill_rand(fb, sizeof(fb));
+
+	for (i = 0; i < ARRAY_SIZE(bpps); i++) {
+		bpp = bpps[i];
+		max = (1 << bpp) - 1;
+		memset(ref, 0, sizeof(ref));
+		p = ref;
+		for (y = clip.y1; y < clip.y2; y++) {
+			shift = 8;
+			for (x = clip.x1; x < clip.x2; x++) {
+				memcpy(&v, &fb[y * pitch + x * 4], 4);
+				g = (((v >> 16) & 0xff) * 77 +
+				     ((v >> 8) & 0xff) * 150 +
+				     (v & 0xff) * 29) >> 8;
+				q = (g * max + 127) / 255;
+				shift -= bpp;
+				*p |= q << shift;
+				if (!shift) {
+					p++;
+					shift = 8;
+				}
+			}
+			if (shift != 8)
+				p++;
+		}
+
+		memset(dst, 0, sizeof(dst));
+		EXPECT(!udrm_conv_clip_gray(dst, fb, pitch, &clip,
+					    DRM_FORMAT_XRGB8888, bpp, 0,
+					    line, err));
+		EXPECT(!memcmp(dst, ref, p - ref));
+	}
+}
+
+/* The decoder described in the UDRM_BUF_MODE_RLE documentation */
+static size_t ref_unrle(u8 *dst, const u8 *src, size_t len, unsigned int cpp)
+{
+	const u8 *end = src + len;
+	u8 *out = dst;
+	unsigned int n, h;
+
+	while (src < end) {
+		h = *src++;
+		n = (h & 0x7f) + 1;
+		if (h & 0x80) {
+			while (n--) {
+				memcpy(out, src, cpp);
+				out += cpp;
+			}
+			src += cpp;
+		} else {
+			memcpy(out, src, n * cpp);
+			out += n * cpp;
+			src += n * cpp;
+		}
+	}
+
+	return out - dst;
+}
+
+static void test_conv_rle(void)
+{
+	static u8 src[4 * 1000], enc[4 * 1000 * 2], dec[4 * 1000];
+	unsigned int cpp, i, run;
+	size_t len, n;
+
+	for (cpp = 1; cpp <= 4; cpp++) {
+		/* Runs of 1 to 300 pixels between literals */
+		len = 1000 * cpp;
+		for (i = 0; i < len; i += run * cpp) {
+			run = 1 + test_rand() % 300;
+			if (i + run * cpp > len)
+				run = (len - i) / cpp;
+			if (test_rand() & 1)
+				fill_rand(&src[i], run * cpp);
+			else
+				for (n = 0; n < run; n++)
+					memcpy(&src[i + n * cpp], &src[i], cpp);
+		}
+
+		n = udrm_conv_rle(enc, sizeof(enc), src, len, cpp);
+		EXPECT(n);
+		EXPECT(ref_unrle(dec, enc, n, cpp) == len);
+		EXPECT(!memcmp(dec, src, len));
+
+		/* Doesn't fit: reports zero instead of overrunning */
+		EXPECT(!udrm_conv_rle(enc, 4, src, len, cpp));
+	}
+}
+
+static void test_conv_row_delta(void)
+{
+	u8 buf[37 * 11], orig[37 * 11];
+
+	fill_rand(orig, sizeof(orig));
+	memcpy(buf, orig, sizeof(buf));
+
+	udrm_conv_row_delta(buf, 37, 11, false);
+	EXPECT(!memcmp(buf, orig, 37));
+	EXPECT(memcmp(buf, orig, sizeof(buf)));
+	udrm_conv_row_delta(buf, 37, 11, true);
+	EXPECT(!memcmp(buf, orig, sizeof(buf)));
+}
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} tests[] = {
+	{ "clip_add_separate", test_clip_add_separate },
+	{ "clip_add_merge_cost", test_clip_add_merge_cost },
+	{ "clip_add_chain", test_clip_add_chain },
+	{ "clip_add_overflow", test_clip_add_overflow },
+	{ "merge_clips_full", test_merge_clips_full },
+	{ "merge_clips_invalid", test_merge_clips_invalid },
+	{ "merge_clips_copy", test_merge_clips_copy },
+	{ "merge_clips_overflow", test_merge_clips_overflow },
+	{ "conv_rgb565_golden", test_conv_rgb565_golden },
+	{ "conv_simd_exact", test_conv_simd_exact },
+	{ "conv_clip_formats", test_conv_clip_formats },
+	{ "conv_clip_gray", test_conv_clip_gray },
+	{ "conv_rle", test_conv_rle },
+	{ "conv_row_delta", test_conv_row_delta },
+};
+
+static double bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* One 1920x1080 frame per iteration, source bytes per second */
+static void bench(void)
+{
+	const unsigned int width = 1920, height = 1080, loops = 50;
+	unsigned int i, l, y;
+	double start, ns;
+	u32 *src;
+	u16 *dst;
+
+	src = malloc(width * height * 4);
+	dst = malloc(width * height * 2);
+	if (!src || !dst)
+		return;
+	fill_rand(src, width * height * 4);
+
+	for (i = 0; i < udrm_test_num_convs(); i++) {
+		if (!udrm_test_conv_usable(i))
+			continue;
+
+		start = bench_ns();
+		for (l = 0; l < loops; l++)
+			for (y = 0; y < height; y++)
+				udrm_test_conv_rgb565(i, dst + y * width,
+						      src + y * width, width,
+						      false);
+		ns = (bench_ns() - start) / loops;
+		printf("# %-16s xrgb8888->rgb565 %7.0f MB/s %5.2f ns/pixel\n",
+		       udrm_test_conv_name(i), width * height * 4 * 1e3 / ns,
+		       ns / (width * height));
+
+		start = bench_ns();
+		for (l = 0; l < loops; l++)
+			for (y = 0; y < height; y++)
+				udrm_test_conv_swab16(i, dst + y * width,
+						      (u16 *)src + y * width,
+						      width);
+		ns = (bench_ns() - start) / loops;
+		printf("# %-16s swab16           %7.0f MB/s %5.2f ns/pixel\n",
+		       udrm_test_conv_name(i), width * height * 2 * 1e3 / ns,
+		       ns / (width * height));
+	}
+
+	free(src);
+	free(dst);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, failures = 0;
+
+	udrm_conv_init();
+
+	printf("TAP version 13\n1..%zu\n", ARRAY_SIZE(tests));
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		failed = false;
+		tests[i].func();
+		printf("%sok %u %s\n", failed ? "not " : "", i + 1,
+		       tests[i].name);
+		failures += failed;
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		bench();
+
+	return failures ? 1 : 0;
+}
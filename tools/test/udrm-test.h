@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef __UDRM_TEST_H
+#define __UDRM_TEST_H
+
+/* The row functions in udrm-conv.c, see udrm-test-conv.c */
+unsigned int udrm_test_num_convs(void);
+const char *udrm_test_conv_name(unsigned int i);
+bool udrm_test_conv_usable(unsigned int i);
+void udrm_test_conv_rgb565(unsigned int i, u16 *dst, const u32 *src,
+			   unsigned int len, bool swap);
+void udrm_test_conv_swab16(unsigned int i, u16 *dst, const u16 *src,
+			   unsigned int len);
+
+#endif /* __UDRM_TEST_H */
@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Counts the allocations made by the udrm module and the dma_buf_vmap()
+# and dma_buf_vunmap() calls during steady state flushing, to check that
+# the flush path allocates and remaps nothing. A device is created with
+# udrm-ref and warmed up, then udrm-load flushes FRAMES frames while the
+# kmem tracepoints and two kprobes are recorded. Allocations are counted
+# by the udrm function they're made from; the DRM core's own allocations,
+# such as the DIRTYFB clip copy, are not counted. Needs root, tracefs,
+# kprobe events, the udrm module and vgem.
+#
+#   MODE=copy+rle DAMAGE=full ./udrm-alloc.sh
+
+FRAMES=${FRAMES:-600}
+MODE=${MODE:-copy}
+SIZE=${SIZE:-320x240}
+DAMAGE=${DAMAGE:-rect}
+DEBUGFS=${DEBUGFS:-/sys/kernel/debug}
+TRACEFS=${TRACEFS:-$DEBUGFS/tracing}
+
+cd "$(dirname "$0")" || exit 1
+
+tmp=$(mktemp -d) || exit 1
+ref=
+
+cleanup() {
+	echo 0 > "$TRACEFS/tracing_on"
+	echo 0 > "$TRACEFS/events/kmem/enable"
+	echo 0 > "$TRACEFS/events/kprobes/enable" 2>/dev/null
+	echo '-:udrm_alloc_vmap' >> "$TRACEFS/kprobe_events" 2>/dev/null
+	echo '-:udrm_alloc_vunmap' >> "$TRACEFS/kprobe_events" 2>/dev/null
+	[ -n "$ref" ] && kill $ref 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+./udrm-ref -m "$MODE" -s "$SIZE" > "$tmp/ref" &
+ref=$!
+
+card=
+for t in $(seq 50); do
+	card=$(awk '/^card/ { print $2 }' "$tmp/ref")
+	[ -n "$card" ] && break
+	sleep 0.1
+done
+if [ -z "$card" ]; then
+	echo "udrm-ref failed" >&2
+	exit 1
+fi
+sleep 1
+
+# Warm up, so one-time allocations aren't counted
+./udrm-load -c "$card" -n 60 -d "$DAMAGE" > /dev/null || exit 1
+
+echo 'p:udrm_alloc_vmap dma_buf_vmap' >> "$TRACEFS/kprobe_events" || exit 1
+echo 'p:udrm_alloc_vunmap dma_buf_vunmap' >> "$TRACEFS/kprobe_events" || exit 1
+echo > "$TRACEFS/trace"
+echo 1 > "$TRACEFS/events/kmem/kmalloc/enable"
+echo 1 > "$TRACEFS/events/kmem/kmalloc_node/enable"
+echo 1 > "$TRACEFS/events/kmem/kmem_cache_alloc/enable"
+echo 1 > "$TRACEFS/events/kmem/kmem_cache_alloc_node/enable"
+echo 1 > "$TRACEFS/events/kprobes/enable"
+echo 1 > "$DEBUGFS/dri/$card/udrm/reset"
+echo 1 > "$TRACEFS/tracing_on"
+
+./udrm-load -c "$card" -n "$FRAMES" -d "$DAMAGE" > /dev/null || exit 1
+
+echo 0 > "$TRACEFS/tracing_on"
+cat "$TRACEFS/trace" > "$tmp/trace"
+flushes=$(awk '/^flushes:/ { print $2 }' "$DEBUGFS/dri/$card/udrm/stats")
+awk '$2 ~ /^[tT]$/ && $4 == "[udrm]"' /proc/kallsyms | sort > "$tmp/syms"
+
+# call_site is either a bare address or, on newer kernels, a symbol
+awk -v flushes="$flushes" -v frames="$FRAMES" '
+	FILENAME == ARGV[1] {
+		addr[n] = $1
+		sym[n] = $3
+		n++
+		next
+	}
+	/udrm_alloc_vmap:/ { vmap++; next }
+	/udrm_alloc_vunmap:/ { vunmap++; next }
+	/call_site=/ {
+		site = $0
+		sub(/.*call_site=/, "", site)
+		sub(/ .*/, "", site)
+		if (site ~ /^[0-9a-f]+$/) {
+			site = sprintf("%16s", site)
+			gsub(/ /, "0", site)
+			name = ""
+			for (i = 0; i < n && addr[i] <= site; i++)
+				name = sym[i]
+			if (name == "" || i == n)
+				next
+		} else if ($0 ~ /\[udrm\]/) {
+			name = site
+			sub(/\+.*/, "", name)
+		} else {
+			next
+		}
+		allocs[name]++
+		total++
+	}
+	END {
+		printf("frames %d flushes %d\n", frames, flushes)
+		printf("udrm allocations %d, %.2f per flush\n", total,
+		       flushes ? total / flushes : 0)
+		for (name in allocs)
+			printf("  %-32s %d\n", name, allocs[name])
+		printf("dma_buf_vmap %d dma_buf_vunmap %d\n", vmap, vunmap)
+	}' "$tmp/syms" "$tmp/trace"
@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# Runs udrm-ref and udrm-load over a matrix of buf_modes, resolutions,
+# damage patterns and presentation paths and prints one line per run:
+# fps, the p50/p99 DIRTYFB or flip latency seen by the compositor, the
+# p50/p99 round-trip of the flush events from the debugfs histogram, and
+# the CPU time per frame of the whole system. Needs root, debugfs, the udrm
+# module and vgem for the buf_modes with a transfer buffer.
+#
+# The matrix can be narrowed down through the environment, for example
+#   MODES="copy copy+rle" SIZES=800x480 ./udrm-bench.sh
+
+MODES=${MODES:-"none copy swap copy+rle gray4 mono zero"}
+SIZES=${SIZES:-"320x240 800x480 1920x1080"}
+DAMAGE=${DAMAGE:-"full rect lines"}
+PRESENT=${PRESENT:-"dirty flip"}
+FRAMES=${FRAMES:-300}
+DEBUGFS=${DEBUGFS:-/sys/kernel/debug}
+REF_ARGS=${REF_ARGS:-}
+
+cd "$(dirname "$0")" || exit 1
+
+tmp=$(mktemp -d) || exit 1
+trap 'kill $ref 2>/dev/null; rm -rf "$tmp"' EXIT
+
+# Busy jiffies of all CPUs
+cpu_busy() {
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 }' /proc/stat
+}
+
+# Bucket i of a debugfs histogram counts durations below 2^i us
+hist_pct() {
+	awk -v pct="$1" '/^event_fb_dirty:/ {
+		n = 0
+		for (i = 1; i <= NF; i++)
+			if ($i == "hist_us:")
+				start = i + 1
+		for (i = start; i <= NF; i++)
+			n += $i
+		if (!n)
+			exit
+		sum = 0
+		for (i = start; i <= NF; i++) {
+			sum += $i
+			if (sum * 100 >= n * pct) {
+				if (i == NF)
+					printf(">=%d", 2 ^ (i - start - 1))
+				else
+					printf("<%d", 2 ^ (i - start))
+				exit
+			}
+		}
+	}' "$2"
+}
+
+printf '%-10s %-10s %-6s %-6s %7s %8s %8s %8s %8s %9s\n' \
+	buf_mode size damage path fps p50_us p99_us rt_p50 rt_p99 cpu_us/fr
+
+for mode in $MODES; do
+for size in $SIZES; do
+	./udrm-ref -m "$mode" -s "$size" $REF_ARGS > "$tmp/ref" &
+	ref=$!
+
+	card=
+	for i in $(seq 50); do
+		card=$(awk '/^card/ { print $2 }' "$tmp/ref")
+		[ -n "$card" ] && break
+		kill -0 $ref 2>/dev/null || break
+		sleep 0.1
+	done
+	if [ -z "$card" ]; then
+		echo "$mode $size: udrm-ref failed" >&2
+		continue
+	fi
+	# Let fbdev emulation set itself up first
+	sleep 1
+
+	for dmg in $DAMAGE; do
+	for path in $PRESENT; do
+		flip=
+		[ "$path" = flip ] && flip=-p
+
+		echo 1 > "$DEBUGFS/dri/$card/udrm/reset"
+		busy=$(cpu_busy)
+		load=$(./udrm-load -c "$card" -n "$FRAMES" -d "$dmg" $flip) ||
+			continue
+		busy=$(($(cpu_busy) - busy))
+		cat "$DEBUGFS/dri/$card/udrm/stats" > "$tmp/stats"
+
+		echo "$load" | awk -v mode="$mode" -v size="$size" \
+			-v dmg="$dmg" -v path="$path" -v busy="$busy" \
+			-v hz="$(getconf CLK_TCK)" \
+			-v rt50="$(hist_pct 50 "$tmp/stats")" \
+			-v rt99="$(hist_pct 99 "$tmp/stats")" '{
+			for (i = 1; i < NF; i += 2)
+				v[$i] = $(i + 1)
+			printf("%-10s %-10s %-6s %-6s %7.1f %8d %8d %8s %8s %9.1f\n",
+			       mode, size, dmg, path, v["fps"], v["p50_us"],
+			       v["p99_us"], rt50, rt99,
+			       busy * 1000000 / hz / v["frames"])
+		}'
+	done
+	done
+
+	kill $ref
+	wait $ref
+	ref=
+done
+done
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Load generator for a udrm DRM node. It sets a mode on a dumb buffer and
+ * then draws a damage pattern every frame, flushing it with DIRTYFB or
+ * presenting it with a page flip, which atomic drivers turn into an atomic
+ * commit. The time from the ioctl until the frame is done is measured:
+ * until DIRTYFB returns, or until the flip event arrives.
+ *
+ * It prints one line with the frame count, fps, p50/p99/max latency in
+ * microseconds and its own CPU time per frame. With several -c options the
+ * devices are driven at the same time, a thread each, with a line per
+ * device, to see whether one device's flushes hold up another's.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <drm/drm.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
+
+#define MAX_CLIPS	16
+#define MAX_DEVS	16
+
+enum damage {
+	DAMAGE_FULL,
+	DAMAGE_RECT,
+	DAMAGE_LINES,
+};
+
+struct buffer {
+	uint32_t handle;
+	uint32_t fb_id;
+	uint32_t pitch;
+	uint64_t size;
+	void *map;
+};
+
+struct dev {
+	unsigned int index;
+	int fd;
+	uint32_t crtc_id;
+	uint32_t conn_id;
+	struct drm_mode_modeinfo mode;
+	unsigned int cpp;
+	struct buffer bufs[2];
+	uint64_t *lat_ns;
+	unsigned int frames;
+	double seconds;
+};
+
+static unsigned int num_frames = 600;
+static enum damage damage = DAMAGE_RECT;
+static uint32_t format = DRM_FORMAT_XRGB8888;
+static int flip;
+static pthread_barrier_t start_barrier;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void dev_open(struct dev *dev)
+{
+	struct drm_mode_card_res res = { 0 };
+	struct drm_mode_get_connector conn = { 0 };
+	struct drm_mode_modeinfo *modes;
+	uint32_t crtc_id, conn_id;
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/dri/card%u", dev->index);
+	dev->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0)
+		die(path);
+
+	/* udrm has exactly one crtc and one connector */
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_GETRESOURCES, &res))
+		die("GETRESOURCES");
+	if (res.count_crtcs < 1 || res.count_connectors < 1) {
+		fprintf(stderr, "%s: no crtc or connector\n", path);
+		exit(1);
+	}
+	res.count_crtcs = 1;
+	res.count_connectors = 1;
+	res.count_fbs = 0;
+	res.count_encoders = 0;
+	res.crtc_id_ptr = (uintptr_t)&crtc_id;
+	res.connector_id_ptr = (uintptr_t)&conn_id;
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_GETRESOURCES, &res))
+		die("GETRESOURCES");
+	dev->crtc_id = crtc_id;
+	dev->conn_id = conn_id;
+
+	conn.connector_id = conn_id;
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn))
+		die("GETCONNECTOR");
+	if (!conn.count_modes) {
+		fprintf(stderr, "%s: no modes\n", path);
+		exit(1);
+	}
+	modes = calloc(conn.count_modes, sizeof(*modes));
+	if (!modes)
+		die("calloc");
+	conn.modes_ptr = (uintptr_t)modes;
+	conn.count_props = 0;
+	conn.count_encoders = 0;
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn))
+		die("GETCONNECTOR");
+	dev->mode = modes[0];
+	free(modes);
+}
+
+static void buffer_create(struct dev *dev, struct buffer *buf)
+{
+	struct drm_mode_create_dumb create = {
+		.width = dev->mode.hdisplay,
+		.height = dev->mode.vdisplay,
+		.bpp = dev->cpp * 8,
+	};
+	struct drm_mode_fb_cmd2 fb = { 0 };
+	struct drm_mode_map_dumb map = { 0 };
+
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+		die("CREATE_DUMB");
+
+	fb.width = create.width;
+	fb.height = create.height;
+	fb.pixel_format = format;
+	fb.handles[0] = create.handle;
+	fb.pitches[0] = create.pitch;
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_ADDFB2, &fb))
+		die("ADDFB2");
+
+	map.handle = create.handle;
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+		die("MAP_DUMB");
+
+	buf->map = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			dev->fd, map.offset);
+	if (buf->map == MAP_FAILED)
+		die("mmap");
+
+	buf->handle = create.handle;
+	buf->fb_id = fb.fb_id;
+	buf->pitch = create.pitch;
+	buf->size = create.size;
+	memset(buf->map, 0, buf->size);
+}
+
+static void dev_setup(struct dev *dev)
+{
+	struct drm_mode_crtc crtc = { 0 };
+
+	dev->cpp = format == DRM_FORMAT_RGB565 ? 2 : 4;
+	buffer_create(dev, &dev->bufs[0]);
+	if (flip)
+		buffer_create(dev, &dev->bufs[1]);
+
+	crtc.crtc_id = dev->crtc_id;
+	crtc.fb_id = dev->bufs[0].fb_id;
+	crtc.set_connectors_ptr = (uintptr_t)&dev->conn_id;
+	crtc.count_connectors = 1;
+	crtc.mode = dev->mode;
+	crtc.mode_valid = 1;
+	if (ioctl(dev->fd, DRM_IOCTL_MODE_SETCRTC, &crtc))
+		die("SETCRTC");
+
+	dev->lat_ns = calloc(num_frames, sizeof(*dev->lat_ns));
+	if (!dev->lat_ns)
+		die("calloc");
+}
+
+static void fill(struct dev *dev, struct buffer *buf,
+		 const struct drm_clip_rect *clip, uint32_t color)
+{
+	unsigned int x, y;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		void *line = buf->map + y * buf->pitch;
+
+		for (x = clip->x1; x < clip->x2; x++) {
+			if (dev->cpp == 2)
+				((uint16_t *)line)[x] = color;
+			else
+				((uint32_t *)line)[x] = color;
+		}
+	}
+}
+
+/* Draw frame n, changing every damaged pixel so tile hashing keeps them */
+static unsigned int draw(struct dev *dev, struct buffer *buf, unsigned int n,
+			 struct drm_clip_rect *clips)
+{
+	unsigned int w = dev->mode.hdisplay, h = dev->mode.vdisplay;
+	uint32_t color = n * 0x010203 + 1;
+	unsigned int i, num_clips;
+
+	switch (damage) {
+	case DAMAGE_FULL:
+		clips[0] = (struct drm_clip_rect){ 0, 0, w, h };
+		num_clips = 1;
+		break;
+	case DAMAGE_RECT:
+		/* A 64x64 square moving across the screen */
+		clips[0].x1 = (n * 8) % (w > 64 ? w - 64 : 1);
+		clips[0].y1 = (n * 4) % (h > 64 ? h - 64 : 1);
+		clips[0].x2 = clips[0].x1 + (w < 64 ? w : 64);
+		clips[0].y2 = clips[0].y1 + (h < 64 ? h : 64);
+		num_clips = 1;
+		break;
+	case DAMAGE_LINES:
+	default:
+		/* Eight scattered text-like lines */
+		num_clips = h >= 8 * 16 ? 8 : 1;
+		for (i = 0; i < num_clips; i++) {
+			clips[i].x1 = (n + i * 37) % (w / 2);
+			clips[i].x2 = clips[i].x1 + w / 2;
+			clips[i].y1 = i * (h / num_clips);
+			clips[i].y2 = clips[i].y1 + (h < 16 ? h : 16);
+		}
+		break;
+	}
+
+	for (i = 0; i < num_clips; i++)
+		fill(dev, buf, &clips[i], color);
+
+	return num_clips;
+}
+
+static void wait_flip(struct dev *dev)
+{
+	char buf[1024];
+	struct drm_event *ev;
+	ssize_t len, i;
+
+	for (;;) {
+		len = read(dev->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read flip event");
+		}
+		for (i = 0; i < len; i += ev->length) {
+			ev = (struct drm_event *)&buf[i];
+			if (ev->type == DRM_EVENT_FLIP_COMPLETE)
+				return;
+		}
+	}
+}
+
+static void dev_run(struct dev *dev)
+{
+	struct drm_clip_rect clips[MAX_CLIPS];
+	struct drm_mode_fb_dirty_cmd dirty = { 0 };
+	struct drm_mode_crtc_page_flip page_flip = { 0 };
+	struct buffer *buf;
+	uint64_t start, t;
+	unsigned int n;
+
+	/* All devices start flushing together */
+	pthread_barrier_wait(&start_barrier);
+
+	start = now_ns();
+	for (n = 0; n < num_frames; n++) {
+		buf = &dev->bufs[flip ? n & 1 : 0];
+		dirty.num_clips = draw(dev, buf, n, clips);
+
+		t = now_ns();
+		if (flip) {
+			page_flip.crtc_id = dev->crtc_id;
+			page_flip.fb_id = buf->fb_id;
+			page_flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+			if (ioctl(dev->fd, DRM_IOCTL_MODE_PAGE_FLIP, &page_flip))
+				die("PAGE_FLIP");
+			wait_flip(dev);
+		} else {
+			dirty.fb_id = buf->fb_id;
+			dirty.clips_ptr = (uintptr_t)clips;
+			if (ioctl(dev->fd, DRM_IOCTL_MODE_DIRTYFB, &dirty))
+				die("DIRTYFB");
+		}
+		dev->lat_ns[n] = now_ns() - t;
+	}
+	dev->seconds = (now_ns() - start) / 1e9;
+	dev->frames = n;
+}
+
+static void *dev_thread(void *arg)
+{
+	dev_run(arg);
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void dev_report(struct dev *dev, double cpu_us_per_frame)
+{
+	uint64_t *lat = dev->lat_ns;
+	unsigned int n = dev->frames;
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf("card %u frames %u fps %.1f p50_us %llu p99_us %llu max_us %llu cpu_us_per_frame %.1f\n",
+	       dev->index, n, n / dev->seconds,
+	       (unsigned long long)lat[n / 2] / 1000,
+	       (unsigned long long)lat[n * 99 / 100] / 1000,
+	       (unsigned long long)lat[n - 1] / 1000,
+	       cpu_us_per_frame);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: udrm-load -c card [-c card...] [-n frames] [-d full|rect|lines]\n"
+		"                 [-f xrgb8888|rgb565] [-p]\n"
+		"-p presents each frame with a page flip instead of DIRTYFB\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct dev devs[MAX_DEVS];
+	pthread_t threads[MAX_DEVS];
+	unsigned int i, num_devs = 0;
+	unsigned long long frames = 0;
+	struct rusage ru;
+	double cpu_us;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:d:f:p")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (num_devs == MAX_DEVS)
+				usage();
+			devs[num_devs++].index = atoi(optarg);
+			break;
+		case 'n':
+			num_frames = atoi(optarg);
+			break;
+		case 'd':
+			if (!strcmp(optarg, "full"))
+				damage = DAMAGE_FULL;
+			else if (!strcmp(optarg, "rect"))
+				damage = DAMAGE_RECT;
+			else if (!strcmp(optarg, "lines"))
+				damage = DAMAGE_LINES;
+			else
+				usage();
+			break;
+		case 'f':
+			if (!strcmp(optarg, "rgb565"))
+				format = DRM_FORMAT_RGB565;
+			else if (!strcmp(optarg, "xrgb8888"))
+				format = DRM_FORMAT_XRGB8888;
+			else
+				usage();
+			break;
+		case 'p':
+			flip = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!num_devs || !num_frames)
+		usage();
+
+	for (i = 0; i < num_devs; i++) {
+		dev_open(&devs[i]);
+		dev_setup(&devs[i]);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, num_devs);
+	for (i = 0; i < num_devs; i++)
+		if (pthread_create(&threads[i], NULL, dev_thread, &devs[i]))
+			die("pthread_create");
+	for (i = 0; i < num_devs; i++) {
+		pthread_join(threads[i], NULL);
+		frames += devs[i].frames;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu_us = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+		 ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	for (i = 0; i < num_devs; i++)
+		dev_report(&devs[i], cpu_us / frames);
+
+	return 0;
+}
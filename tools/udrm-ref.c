@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Reference userspace driver. It creates a udrm device and answers every
+ * event, copying the flushed pixels out of the transfer buffer (or the
+ * framebuffer with zero-copy) as a real panel driver would before sending
+ * them. No hardware is involved, so it runs in a VM without a GPU.
+ *
+ * The transfer buffers are dumb buffers exported from vgem. The DRM minor
+ * of the new device is printed as "card <index>" once it's registered.
+ * On SIGINT/SIGTERM it prints the number of flushes and the CPU time it
+ * used per flush, then closes /dev/udrm which removes the device.
+ *
+ * With -a it attaches to the persistent device named by -n instead, the
+ * other settings are then taken from the device. With -k it closes the dma-buf fds of zero-copy framebuffers as soon as
+ * they arrive, which test/udrm-export.sh uses.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <drm/drm.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
+
+/* The buf_mode flags use the kernel's BIT() */
+#ifndef BIT
+#define BIT(n)	(1U << (n))
+#endif
+#include <drm/udrm.h>
+
+#define MAX_FBS		64
+
+struct fb {
+	uint32_t id;
+	int fd;
+	void *map;
+	size_t size;
+	uint32_t pitch;
+	uint32_t cpp;
+};
+
+static const struct {
+	const char *name;
+	uint32_t mode;
+} buf_modes[] = {
+	{ "none",	UDRM_BUF_MODE_NONE },
+	{ "copy",	UDRM_BUF_MODE_PLAIN_COPY },
+	{ "swap",	UDRM_BUF_MODE_SWAP_BYTES },
+	{ "gray8",	UDRM_BUF_MODE_GRAY8 },
+	{ "gray4",	UDRM_BUF_MODE_GRAY4 },
+	{ "gray2",	UDRM_BUF_MODE_GRAY2 },
+	{ "mono",	UDRM_BUF_MODE_MONO },
+	{ "zero",	UDRM_BUF_MODE_ZERO_COPY },
+};
+
+static volatile sig_atomic_t quit;
+static struct fb fbs[MAX_FBS];
+static void *bufs[UDRM_MAX_BUFS];
+static size_t shadow_size;
+static unsigned char *shadow;
+static unsigned long long flushes;
+static unsigned int delay_us;
+static int drop_fds;
+static int attach;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A CVT-like mode, udrm only uses the timings for the refresh rate */
+static void make_mode(struct drm_mode_modeinfo *mode, unsigned int width,
+		      unsigned int height, unsigned int refresh)
+{
+	memset(mode, 0, sizeof(*mode));
+	mode->hdisplay = width;
+	mode->hsync_start = width + 8;
+	mode->hsync_end = width + 16;
+	mode->htotal = width + 24;
+	mode->vdisplay = height;
+	mode->vsync_start = height + 2;
+	mode->vsync_end = height + 4;
+	mode->vtotal = height + 6;
+	mode->vrefresh = refresh;
+	mode->clock = (uint64_t)mode->htotal * mode->vtotal * refresh / 1000;
+	mode->type = DRM_MODE_TYPE_DRIVER | DRM_MODE_TYPE_PREFERRED;
+	snprintf(mode->name, sizeof(mode->name), "%ux%u", width, height);
+}
+
+static int open_vgem(void)
+{
+	char name[16];
+	struct drm_version version;
+	glob_t g;
+	size_t i;
+	int fd;
+
+	if (glob("/dev/dri/card*", 0, NULL, &g))
+		return -1;
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		fd = open(g.gl_pathv[i], O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		memset(&version, 0, sizeof(version));
+		memset(name, 0, sizeof(name));
+		version.name = name;
+		version.name_len = sizeof(name) - 1;
+		if (!ioctl(fd, DRM_IOCTL_VERSION, &version) &&
+		    !strcmp(name, "vgem")) {
+			globfree(&g);
+			return fd;
+		}
+		close(fd);
+	}
+	globfree(&g);
+
+	return -1;
+}
+
+/* Big enough for any buf_mode at XRGB8888 */
+static int vgem_buf(int vgem, unsigned int width, unsigned int height,
+		    void **map)
+{
+	struct drm_mode_create_dumb create = {
+		.width = width,
+		.height = height,
+		.bpp = 32,
+	};
+	struct drm_mode_map_dumb map_dumb = { 0 };
+	struct drm_prime_handle prime = { 0 };
+
+	if (ioctl(vgem, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+		die("vgem create dumb");
+
+	map_dumb.handle = create.handle;
+	if (ioctl(vgem, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb))
+		die("vgem map dumb");
+
+	*map = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    vgem, map_dumb.offset);
+	if (*map == MAP_FAILED)
+		die("vgem mmap");
+
+	prime.handle = create.handle;
+	prime.flags = DRM_CLOEXEC;
+	if (ioctl(vgem, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime))
+		die("vgem export");
+
+	return prime.fd;
+}
+
+static struct fb *fb_lookup(uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_FBS; i++)
+		if (fbs[i].id == id)
+			return &fbs[i];
+
+	return NULL;
+}
+
+static void fb_create(struct udrm_event_fb *ev)
+{
+	struct fb *fb = fb_lookup(0);
+
+	if (ev->buf_fd < 0)
+		return;
+
+	/* -k: let the kernel keep the only reference to the framebuffer */
+	if (!fb || drop_fds) {
+		close(ev->buf_fd);
+		return;
+	}
+
+	fb->id = ev->fb_id;
+	fb->fd = ev->buf_fd;
+	fb->pitch = ev->pitch;
+	fb->cpp = ev->pitch / ev->width;
+	fb->size = (size_t)ev->pitch * ev->height;
+	fb->map = mmap(NULL, fb->size, PROT_READ, MAP_SHARED, fb->fd, 0);
+	if (fb->map == MAP_FAILED)
+		fb->map = NULL;
+}
+
+static void fb_destroy(struct udrm_event_fb *ev)
+{
+	struct fb *fb = fb_lookup(ev->fb_id);
+
+	if (!fb || !fb->id)
+		return;
+
+	if (fb->map)
+		munmap(fb->map, fb->size);
+	close(fb->fd);
+	memset(fb, 0, sizeof(*fb));
+}
+
+/* What a panel driver does with a flush: get the pixels out */
+static void fb_dirty(struct udrm_event_fb_dirty *ev)
+{
+	struct drm_clip_rect *clip;
+	size_t pos = 0, len;
+	unsigned int i, y;
+	struct fb *fb;
+
+	flushes++;
+
+	if (ev->base.type == UDRM_EVENT_FB_FILL)
+		goto out;
+
+	if (ev->buf_len && ev->buf_index < UDRM_MAX_BUFS &&
+	    bufs[ev->buf_index]) {
+		len = ev->buf_len < shadow_size ? ev->buf_len : shadow_size;
+		memcpy(shadow, bufs[ev->buf_index], len);
+		goto out;
+	}
+
+	fb = fb_lookup(ev->fb_dirty_cmd.fb_id);
+	if (!fb || !fb->id || !fb->map)
+		goto out;
+
+	for (i = 0; i < ev->fb_dirty_cmd.num_clips; i++) {
+		clip = &ev->clips[i];
+		if (clip->x2 <= clip->x1)
+			continue;
+		len = (size_t)(clip->x2 - clip->x1) * fb->cpp;
+		for (y = clip->y1; y < clip->y2; y++) {
+			if (pos + len > shadow_size ||
+			    (size_t)y * fb->pitch + clip->x2 * fb->cpp > fb->size)
+				break;
+			memcpy(shadow + pos, fb->map + y * fb->pitch +
+			       clip->x1 * fb->cpp, len);
+			pos += len;
+		}
+	}
+out:
+	if (delay_us)
+		usleep(delay_us);
+}
+
+static void handle_event(struct udrm_event *ev, struct udrm_event_reply *reply)
+{
+	memset(reply, 0, sizeof(*reply));
+	reply->seq = ev->seq;
+
+	switch (ev->type) {
+	case UDRM_EVENT_FB_CREATE:
+		fb_create((struct udrm_event_fb *)ev);
+		break;
+	case UDRM_EVENT_FB_DESTROY:
+		fb_destroy((struct udrm_event_fb *)ev);
+		break;
+	case UDRM_EVENT_FB_DIRTY:
+	case UDRM_EVENT_FB_COPY:
+	case UDRM_EVENT_FB_FILL:
+		fb_dirty((struct udrm_event_fb_dirty *)ev);
+		reply->flags = UDRM_REPLY_TIMESTAMP;
+		reply->timestamp_ns = now_ns();
+		break;
+	}
+}
+
+static void run_read(int fd)
+{
+	static unsigned char buf[64 * 1024];
+	struct udrm_event_reply reply;
+	ssize_t ret;
+
+	while (!quit) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read");
+		}
+		if (ret < (ssize_t)sizeof(struct udrm_event))
+			continue;
+
+		handle_event((struct udrm_event *)buf, &reply);
+		if (write(fd, &reply, sizeof(reply)) < 0 && errno != EINTR)
+			die("write");
+	}
+}
+
+static void run_ring(int fd, size_t size)
+{
+	struct udrm_event_reply *cq;
+	struct udrm_ring *ring;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint32_t head, tail, mask;
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		die("mmap ring");
+
+	mask = ring->num_entries - 1;
+	cq = (void *)ring + ring->cq_offset;
+
+	while (!quit) {
+		head = ring->sq_head;
+		tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				die("poll");
+			continue;
+		}
+
+		for (; head != tail; head++) {
+			struct udrm_event *ev = (void *)ring + ring->sq_offset +
+				(head & mask) * ring->sq_entry_size;
+			uint32_t cq_tail = ring->cq_tail;
+
+			handle_event(ev, &cq[cq_tail & mask]);
+			__atomic_store_n(&ring->cq_tail, cq_tail + 1,
+					 __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&ring->sq_head, head, __ATOMIC_RELEASE);
+
+		if (ioctl(fd, UDRM_RING_COMPLETE) && errno != EINTR)
+			die("UDRM_RING_COMPLETE");
+	}
+}
+
+/* Pick up a persistent device, it replays its framebuffers */
+static void dev_attach(int fd, struct udrm_dev_create *dev_create)
+{
+	struct udrm_dev_attach dev_attach;
+	unsigned int i;
+	off_t size;
+
+	memset(&dev_attach, 0, sizeof(dev_attach));
+	memcpy(dev_attach.name, dev_create->name, sizeof(dev_attach.name));
+	dev_attach.flags = dev_create->flags &
+			   (UDRM_DEV_FLAG_RING | UDRM_DEV_FLAG_PERSIST);
+
+	if (ioctl(fd, UDRM_DEV_ATTACH, &dev_attach))
+		die("UDRM_DEV_ATTACH");
+
+	for (i = 0; i < dev_attach.num_bufs && i < UDRM_MAX_BUFS; i++) {
+		size = lseek(dev_attach.buf_fds[i], 0, SEEK_END);
+		if (size <= 0)
+			die("transfer buffer size");
+		bufs[i] = mmap(NULL, size, PROT_READ, MAP_SHARED,
+			       dev_attach.buf_fds[i], 0);
+		if (bufs[i] == MAP_FAILED)
+			die("transfer buffer mmap");
+	}
+
+	dev_create->index = dev_attach.index;
+	dev_create->ring_size = dev_attach.ring_size;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: udrm-ref [-n name] [-s WxH] [-r refresh] [-m buf_mode]\n"
+		"                [-f xrgb8888|rgb565] [-b num_bufs] [-q depth]\n"
+		"                [-c max_clips] [-d delay_us] [-x flags] [-C cpu] [-R] [-k] [-a]\n"
+		"buf_mode: none copy swap gray8 gray4 gray2 mono zero,\n"
+		"          optionally followed by +rle or +delta\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct udrm_dev_create dev_create;
+	unsigned int width = 320, height = 240, refresh = 60;
+	uint32_t formats[2] = { DRM_FORMAT_XRGB8888 };
+	const char *mode_name = "copy";
+	unsigned int num_bufs = 1, i;
+	struct sigaction sa;
+	struct rusage ru;
+	char *suffix;
+	int fd, vgem, opt;
+	double cpu_us;
+
+	memset(&dev_create, 0, sizeof(dev_create));
+	strcpy(dev_create.name, "udrm-ref");
+	dev_create.num_formats = 1;
+
+	while ((opt = getopt(argc, argv, "n:s:r:m:f:b:q:c:d:x:C:Rka")) != -1) {
+		switch (opt) {
+		case 'n':
+			snprintf(dev_create.name, sizeof(dev_create.name),
+				 "%s", optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+				usage();
+			break;
+		case 'r':
+			refresh = atoi(optarg);
+			break;
+		case 'm':
+			mode_name = optarg;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "rgb565")) {
+				formats[0] = DRM_FORMAT_RGB565;
+				formats[1] = DRM_FORMAT_XRGB8888;
+				dev_create.num_formats = 2;
+				dev_create.buf_mode |= UDRM_BUF_MODE_EMULATE;
+			} else if (strcmp(optarg, "xrgb8888")) {
+				usage();
+			}
+			break;
+		case 'b':
+			num_bufs = atoi(optarg);
+			break;
+		case 'q':
+			dev_create.queue_depth = atoi(optarg);
+			break;
+		case 'c':
+			dev_create.max_clips = atoi(optarg);
+			break;
+		case 'd':
+			delay_us = atoi(optarg);
+			break;
+		case 'x':
+			dev_create.flags |= strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			dev_create.flags |= UDRM_DEV_FLAG_CPU;
+			dev_create.cpu = atoi(optarg);
+			break;
+		case 'R':
+			dev_create.flags |= UDRM_DEV_FLAG_RING;
+			break;
+		case 'k':
+			drop_fds = 1;
+			break;
+		case 'a':
+			attach = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!width || !height || !refresh || !num_bufs ||
+	    num_bufs > UDRM_MAX_BUFS)
+		usage();
+
+	suffix = strchr(mode_name, '+');
+	if (suffix) {
+		*suffix++ = '\0';
+		if (!strcmp(suffix, "rle"))
+			dev_create.buf_mode |= UDRM_BUF_MODE_RLE;
+		else if (!strcmp(suffix, "delta"))
+			dev_create.buf_mode |= UDRM_BUF_MODE_ROW_DELTA;
+		else
+			usage();
+	}
+
+	for (i = 0; i < sizeof(buf_modes) / sizeof(buf_modes[0]); i++)
+		if (!strcmp(mode_name, buf_modes[i].name))
+			break;
+	if (i == sizeof(buf_modes) / sizeof(buf_modes[0]))
+		usage();
+	dev_create.buf_mode |= buf_modes[i].mode;
+
+	/* The grayscale modes convert from XRGB8888 themselves */
+	if (buf_modes[i].mode >= UDRM_BUF_MODE_GRAY8 &&
+	    buf_modes[i].mode <= UDRM_BUF_MODE_MONO)
+		dev_create.buf_mode &= ~UDRM_BUF_MODE_EMULATE;
+
+	make_mode(&dev_create.mode, width, height, refresh);
+	dev_create.formats = (uintptr_t)formats;
+	dev_create.buf_fd = -1;
+
+	shadow_size = (size_t)width * height * 4;
+	shadow = malloc(shadow_size);
+	if (!shadow)
+		die("malloc");
+
+	if (!attach && buf_modes[i].mode != UDRM_BUF_MODE_NONE &&
+	    buf_modes[i].mode != UDRM_BUF_MODE_ZERO_COPY) {
+		vgem = open_vgem();
+		if (vgem < 0) {
+			fprintf(stderr, "no vgem device, modprobe vgem\n");
+			return 1;
+		}
+		dev_create.num_bufs = num_bufs;
+		for (i = 0; i < num_bufs; i++)
+			dev_create.buf_fds[i] = vgem_buf(vgem, width, height,
+							 &bufs[i]);
+	}
+
+	fd = open("/dev/udrm", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		die("/dev/udrm");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (attach)
+		dev_attach(fd, &dev_create);
+	else if (ioctl(fd, UDRM_DEV_CREATE, &dev_create))
+		die("UDRM_DEV_CREATE");
+
+	printf("card %u\n", dev_create.index);
+	fflush(stdout);
+
+	if (dev_create.flags & UDRM_DEV_FLAG_RING)
+		run_ring(fd, dev_create.ring_size);
+	else
+		run_read(fd);
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu_us = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+		 ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	printf("flushes %llu cpu_us_per_flush %.1f\n", flushes,
+	       flushes ? cpu_us / flushes : 0.0);
+
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Flush latency against the number of devices. For each count in COUNTS it
+# creates that many devices with udrm-ref, flushes all of them at the same
+# time with udrm-load and prints the p50/p99 DIRTYFB latency of the
+# slowest device. With SLOW_US set there is one more device, whose
+# userspace driver takes that long per flush. It's left out of the
+# numbers, so they show how much one slow panel holds up the others.
+# Needs root and the udrm module, plus vgem for buf_modes with a transfer
+# buffer.
+#
+#   SLOW_US=20000 REF_ARGS="-x 0x10" ./udrm-scale.sh
+
+COUNTS=${COUNTS:-"1 2 4 8 12 16"}
+FRAMES=${FRAMES:-300}
+SIZE=${SIZE:-320x240}
+DAMAGE=${DAMAGE:-rect}
+REF_ARGS=${REF_ARGS:-"-m copy"}
+SLOW_US=${SLOW_US:-}
+
+cd "$(dirname "$0")" || exit 1
+
+tmp=$(mktemp -d) || exit 1
+refs=
+trap 'kill $refs 2>/dev/null; rm -rf "$tmp"' EXIT
+
+printf '%-8s %8s %8s %8s %8s\n' devices fps p50_us p99_us max_us
+
+for count in $COUNTS; do
+	refs=
+	cards=
+	total=$count
+	[ -n "$SLOW_US" ] && total=$((count + 1))
+	for i in $(seq "$total"); do
+		slow=
+		[ "$i" = 1 ] && [ -n "$SLOW_US" ] && slow="-d $SLOW_US"
+		./udrm-ref -n "udrm-scale-$i" -s "$SIZE" $REF_ARGS $slow \
+			> "$tmp/ref$i" &
+		refs="$refs $!"
+	done
+
+	for i in $(seq "$total"); do
+		card=
+		for t in $(seq 50); do
+			card=$(awk '/^card/ { print $2 }' "$tmp/ref$i")
+			[ -n "$card" ] && break
+			sleep 0.1
+		done
+		if [ -z "$card" ]; then
+			echo "udrm-ref $i failed" >&2
+			exit 1
+		fi
+		cards="$cards -c $card"
+	done
+	# Let fbdev emulation set itself up first
+	sleep 1
+
+	./udrm-load $cards -n "$FRAMES" -d "$DAMAGE" > "$tmp/load" || exit 1
+
+	# Line 1 is the slow device if there is one
+	skip=0
+	[ -n "$SLOW_US" ] && skip=1
+	awk -v count="$count" -v skip="$skip" 'NR > skip {
+		for (i = 1; i < NF; i += 2)
+			v[$i] = $(i + 1)
+		fps += v["fps"]
+		n++
+		if (v["p50_us"] > p50)
+			p50 = v["p50_us"]
+		if (v["p99_us"] > p99)
+			p99 = v["p99_us"]
+		if (v["max_us"] > max)
+			max = v["max_us"]
+	} END {
+		printf("%-8d %8.1f %8d %8d %8d\n", count, fps / n, p50, p99, max)
+	}' "$tmp/load"
+
+	kill $refs
+	wait $refs 2>/dev/null
+	refs=
+done
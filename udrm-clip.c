@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <drm/drmP.h>
+
+#include <uapi/drm/udrm.h>
+
+#include "udrm.h"
+
+/*
+ * Damage rectangle helpers. They only deal with struct drm_clip_rect and
+ * don't touch the device, so they can be exercised on their own.
+ */
+
+u64 udrm_clip_area(const struct drm_clip_rect *clip)
+{
+	return (u64)(clip->x2 - clip->x1) * (clip->y2 - clip->y1);
+}
+
+void udrm_clip_union(struct drm_clip_rect *dst,
+		     const struct drm_clip_rect *src)
+{
+	dst->x1 = min(dst->x1, src->x1);
+	dst->x2 = max(dst->x2, src->x2);
+	dst->y1 = min(dst->y1, src->y1);
+	dst->y2 = max(dst->y2, src->y2);
+}
+
+bool udrm_clip_valid(const struct drm_clip_rect *clip,
+		     u32 max_width, u32 max_height)
+{
+	return clip->x2 <= max_width && clip->y2 <= max_height &&
+	       clip->x1 < clip->x2 && clip->y1 < clip->y2;
+}
+
+bool udrm_clip_same_size(const struct drm_clip_rect *a,
+			 const struct drm_clip_rect *b)
+{
+	return a->x2 - a->x1 == b->x2 - b->x1 &&
+	       a->y2 - a->y1 == b->y2 - b->y1;
+}
+
+/* Extra pixels transferred if @a and @b are sent as their bounding box */
+static s64 udrm_clip_merge_cost(const struct drm_clip_rect *a,
+				const struct drm_clip_rect *b)
+{
+	struct drm_clip_rect u = *a;
+
+	udrm_clip_union(&u, b);
+
+	return udrm_clip_area(&u) - udrm_clip_area(a) - udrm_clip_area(b);
+}
+
+/*
+ * Add @clip to the @num_clips rectangles in @clips. Rectangles are merged
+ * when the extra pixels cost less than setting up another transfer
+ * (@clip_cost), or when there's no room left. @clips must have room for
+ * @max_clips + 1 entries.
+ */
+void udrm_clip_add(struct drm_clip_rect *clips, unsigned int *num_clips,
+		   unsigned int max_clips, u32 clip_cost,
+		   const struct drm_clip_rect *clip)
+{
+	struct drm_clip_rect new = *clip;
+	unsigned int i, j, n = *num_clips;
+	unsigned int best_i = 0, best_j = 1;
+	s64 cost, best = S64_MAX;
+	bool merged;
+
+	do {
+		merged = false;
+		for (i = 0; i < n; i++) {
+			if (udrm_clip_merge_cost(&clips[i], &new) <= clip_cost) {
+				udrm_clip_union(&new, &clips[i]);
+				clips[i] = clips[--n];
+				merged = true;
+				break;
+			}
+		}
+	} while (merged);
+
+	clips[n++] = new;
+
+	if (n > max_clips) {
+		for (i = 0; i < n; i++) {
+			for (j = i + 1; j < n; j++) {
+				cost = udrm_clip_merge_cost(&clips[i], &clips[j]);
+				if (cost < best) {
+					best = cost;
+					best_i = i;
+					best_j = j;
+				}
+			}
+		}
+		udrm_clip_union(&clips[best_i], &clips[best_j]);
+		clips[best_j] = clips[--n];
+	}
+
+	*num_clips = n;
+}
+
+/*
+ * Reduce the @num_clips rectangles in @src to at most @max_clips in @dst,
+ * which must have room for @max_clips + 1 entries. An invalid rectangle
+ * results in a full flush. Returns the number of rectangles in @dst.
+ */
+unsigned int udrm_merge_clips(struct drm_clip_rect *dst,
+			      unsigned int max_clips, u32 clip_cost,
+			      struct drm_clip_rect *src,
+			      unsigned int num_clips, unsigned int flags,
+			      u32 max_width, u32 max_height)
+{
+	unsigned int i, n = 0, step = 1;
+
+	if (!src || !num_clips)
+		goto full;
+
+	/* Copies are src/dst pairs, only the destination is damaged */
+	if (flags & DRM_MODE_FB_DIRTY_ANNOTATE_COPY) {
+		src++;
+		num_clips--;
+		step = 2;
+	}
+
+	for (i = 0; i < num_clips; i += step) {
+		if (!udrm_clip_valid(&src[i], max_width, max_height)) {
+			DRM_DEBUG_KMS("Illegal clip: x1=%u, x2=%u, y1=%u, y2=%u\n",
+				      src[i].x1, src[i].x2, src[i].y1, src[i].y2);
+			goto full;
+		}
+		udrm_clip_add(dst, &n, max_clips, clip_cost, &src[i]);
+	}
+
+	if (n)
+		return n;
+full:
+	dst->x1 = 0;
+	dst->x2 = max_width;
+	dst->y1 = 0;
+	dst->y2 = max_height;
+
+	return 1;
+}
@@ -0,0 +1,798 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <drm/drmP.h>
+#include <linux/swab.h>
+#include <asm/unaligned.h>
+
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#endif
+
+#include <uapi/drm/udrm.h>
+
+#include "udrm.h"
+
+/*
+ * Pixel conversion for the transfer buffer. The clip loops are shared and
+ * call row functions, which have SIMD versions picked at module init.
+ * @begin/@end bracket at most UDRM_CONV_CHUNK source bytes, since preemption
+ * is off while the FPU/NEON state is held. The crypto and raid6 code bound
+ * it the same way.
+ */
+#define UDRM_CONV_CHUNK		4096
+
+struct udrm_conv_funcs {
+	const char *name;
+	void (*begin)(void);
+	void (*end)(void);
+	void (*rgb565)(u16 *dst, const u32 *src, unsigned int len, bool swap);
+	void (*swap16)(u16 *dst, const u16 *src, unsigned int len);
+};
+
+static void udrm_conv_rgb565_row(u16 *dst, const u32 *src, unsigned int len,
+				 bool swap)
+{
+	unsigned int x;
+	u16 val16;
+
+	if (swap) {
+		for (x = 0; x < len; x++) {
+			val16 = ((src[x] & 0x00F80000) >> 8) |
+				((src[x] & 0x0000FC00) >> 5) |
+				((src[x] & 0x000000F8) >> 3);
+			dst[x] = swab16(val16);
+		}
+	} else {
+		for (x = 0; x < len; x++)
+			dst[x] = ((src[x] & 0x00F80000) >> 8) |
+				 ((src[x] & 0x0000FC00) >> 5) |
+				 ((src[x] & 0x000000F8) >> 3);
+	}
+}
+
+static void udrm_conv_swab16_row(u16 *dst, const u16 *src, unsigned int len)
+{
+	unsigned int x;
+
+	for (x = 0; x < len; x++)
+		dst[x] = swab16(src[x]);
+}
+
+static const struct udrm_conv_funcs udrm_conv_scalar = {
+	.name = "scalar",
+	.rgb565 = udrm_conv_rgb565_row,
+	.swap16 = udrm_conv_swab16_row,
+};
+
+#ifdef CONFIG_X86
+/*
+ * The kernel isn't built to use the SSE registers itself, so like
+ * lib/raid6/sse2.c the masks stay loaded in xmm5-xmm7 across asm statements
+ * between kernel_fpu_begin() and kernel_fpu_end().
+ */
+static const u32 udrm_sse2_masks[3][4] __aligned(16) = {
+	{ 0xf800, 0xf800, 0xf800, 0xf800 },
+	{ 0x07e0, 0x07e0, 0x07e0, 0x07e0 },
+	{ 0x001f, 0x001f, 0x001f, 0x001f },
+};
+
+static void udrm_sse2_begin(void)
+{
+	kernel_fpu_begin();
+	asm volatile("movdqa %0, %%xmm5\n\t"
+		     "movdqa %1, %%xmm6\n\t"
+		     "movdqa %2, %%xmm7"
+		     : : "m" (udrm_sse2_masks[0]), "m" (udrm_sse2_masks[1]),
+			 "m" (udrm_sse2_masks[2]));
+}
+
+static void udrm_sse2_end(void)
+{
+	kernel_fpu_end();
+}
+
+/*
+ * Convert the 8 XRGB8888 pixels in xmm0 and xmm1 to RGB565 in xmm0.
+ * packssdw saturates, so sign extend the 16-bit results first.
+ */
+#define UDRM_SSE2_RGB565(reg)			\
+	"movdqa " reg ", %%xmm2\n\t"		\
+	"psrld $8, %%xmm2\n\t"			\
+	"pand %%xmm5, %%xmm2\n\t"		\
+	"movdqa " reg ", %%xmm3\n\t"		\
+	"psrld $5, %%xmm3\n\t"			\
+	"pand %%xmm6, %%xmm3\n\t"		\
+	"por %%xmm3, %%xmm2\n\t"		\
+	"psrld $3, " reg "\n\t"			\
+	"pand %%xmm7, " reg "\n\t"		\
+	"por %%xmm2, " reg "\n\t"		\
+	"pslld $16, " reg "\n\t"		\
+	"psrad $16, " reg "\n\t"
+
+#define UDRM_SSE2_PACK_RGB565			\
+	UDRM_SSE2_RGB565("%%xmm0")		\
+	UDRM_SSE2_RGB565("%%xmm1")		\
+	"packssdw %%xmm1, %%xmm0\n\t"
+
+#define UDRM_SSE2_SWAB16			\
+	"movdqa %%xmm0, %%xmm2\n\t"		\
+	"psllw $8, %%xmm0\n\t"			\
+	"psrlw $8, %%xmm2\n\t"			\
+	"por %%xmm2, %%xmm0\n\t"
+
+static void udrm_sse2_rgb565_row(u16 *dst, const u32 *src, unsigned int len,
+				 bool swap)
+{
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		asm volatile("movdqu (%0), %%xmm0\n\t"
+			     "movdqu 16(%0), %%xmm1\n\t"
+			     UDRM_SSE2_PACK_RGB565
+			     : : "r" (src) : "memory");
+		if (swap)
+			asm volatile(UDRM_SSE2_SWAB16 : : );
+		asm volatile("movdqu %%xmm0, (%0)" : : "r" (dst) : "memory");
+	}
+
+	udrm_conv_rgb565_row(dst, src, len, swap);
+}
+
+static void udrm_sse2_swab16_row(u16 *dst, const u16 *src, unsigned int len)
+{
+	for (; len >= 8; len -= 8, src += 8, dst += 8)
+		asm volatile("movdqu (%0), %%xmm0\n\t"
+			     UDRM_SSE2_SWAB16
+			     "movdqu %%xmm0, (%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+
+	udrm_conv_swab16_row(dst, src, len);
+}
+
+static const struct udrm_conv_funcs udrm_conv_sse2 = {
+	.name = "sse2",
+	.begin = udrm_sse2_begin,
+	.end = udrm_sse2_end,
+	.rgb565 = udrm_sse2_rgb565_row,
+	.swap16 = udrm_sse2_swab16_row,
+};
+
+/*
+ * Plain loads from write-combined memory are uncached and very slow.
+ * MOVNTDQA (SSE4.1) reads a whole line into a streaming buffer instead.
+ * It needs 16 byte aligned addresses, so the unaligned head is done with
+ * the scalar code.
+ */
+static unsigned int udrm_sse41_head(const void *src, unsigned int len,
+				    unsigned int cpp)
+{
+	if ((unsigned long)src & (cpp - 1))
+		return len;
+
+	return min_t(unsigned int, len, (-(unsigned long)src & 15) / cpp);
+}
+
+static void udrm_sse41_rgb565_row(u16 *dst, const u32 *src, unsigned int len,
+				  bool swap)
+{
+	unsigned int head = udrm_sse41_head(src, len, 4);
+
+	udrm_conv_rgb565_row(dst, src, head, swap);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		asm volatile("movntdqa (%0), %%xmm0\n\t"
+			     "movntdqa 16(%0), %%xmm1\n\t"
+			     UDRM_SSE2_PACK_RGB565
+			     : : "r" (src) : "memory");
+		if (swap)
+			asm volatile(UDRM_SSE2_SWAB16 : : );
+		asm volatile("movdqu %%xmm0, (%0)" : : "r" (dst) : "memory");
+	}
+
+	udrm_conv_rgb565_row(dst, src, len, swap);
+}
+
+static void udrm_sse41_swab16_row(u16 *dst, const u16 *src, unsigned int len)
+{
+	unsigned int head = udrm_sse41_head(src, len, 2);
+
+	udrm_conv_swab16_row(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 8)
+		asm volatile("movntdqa (%0), %%xmm0\n\t"
+			     UDRM_SSE2_SWAB16
+			     "movdqu %%xmm0, (%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+
+	udrm_conv_swab16_row(dst, src, len);
+}
+
+static const struct udrm_conv_funcs udrm_conv_sse41 = {
+	.name = "sse4.1 streaming",
+	.begin = udrm_sse2_begin,
+	.end = udrm_sse2_end,
+	.rgb565 = udrm_sse41_rgb565_row,
+	.swap16 = udrm_sse41_swab16_row,
+};
+#endif
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+/* In udrm-neon.c, they do multiples of 8 pixels */
+void udrm_neon_rgb565(u16 *dst, const u32 *src, unsigned int len, int swap);
+void udrm_neon_swab16(u16 *dst, const u16 *src, unsigned int len);
+
+static void udrm_neon_begin(void)
+{
+	kernel_neon_begin();
+}
+
+static void udrm_neon_end(void)
+{
+	kernel_neon_end();
+}
+
+static void udrm_neon_rgb565_row(u16 *dst, const u32 *src, unsigned int len,
+				 bool swap)
+{
+	unsigned int body = len & ~7;
+
+	udrm_neon_rgb565(dst, src, body, swap);
+	udrm_conv_rgb565_row(dst + body, src + body, len - body, swap);
+}
+
+static void udrm_neon_swab16_row(u16 *dst, const u16 *src, unsigned int len)
+{
+	unsigned int body = len & ~7;
+
+	udrm_neon_swab16(dst, src, body);
+	udrm_conv_swab16_row(dst + body, src + body, len - body);
+}
+
+static const struct udrm_conv_funcs udrm_conv_neon = {
+	.name = "neon",
+	.begin = udrm_neon_begin,
+	.end = udrm_neon_end,
+	.rgb565 = udrm_neon_rgb565_row,
+	.swap16 = udrm_neon_swab16_row,
+};
+#endif
+
+/* For cached sources and for write-combined (CMA) sources */
+static const struct udrm_conv_funcs *udrm_conv = &udrm_conv_scalar;
+static const struct udrm_conv_funcs *udrm_conv_wc = &udrm_conv_scalar;
+
+void udrm_conv_init(void)
+{
+#ifdef CONFIG_X86
+	if (boot_cpu_has(X86_FEATURE_XMM2))
+		udrm_conv = udrm_conv_wc = &udrm_conv_sse2;
+	if (boot_cpu_has(X86_FEATURE_XMM4_1))
+		udrm_conv_wc = &udrm_conv_sse41;
+#endif
+#ifdef CONFIG_KERNEL_MODE_NEON
+	if (cpu_has_neon())
+		udrm_conv = udrm_conv_wc = &udrm_conv_neon;
+#endif
+	DRM_DEBUG_DRIVER("Pixel conversion: %s, write-combined source: %s\n",
+			 udrm_conv->name, udrm_conv_wc->name);
+}
+
+static void udrm_conv_xrgb8888_to_rgb565(u16 *dst, void *vaddr,
+					 unsigned int pitch,
+					 const struct drm_clip_rect *clip,
+					 bool swap, bool wc)
+{
+	const struct udrm_conv_funcs *conv = wc ? udrm_conv_wc : udrm_conv;
+	unsigned int len = clip->x2 - clip->x1;
+	unsigned int x, y, n;
+	u32 *src;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		src = vaddr + (y * pitch);
+		src += clip->x1;
+		for (x = 0; x < len; x += n) {
+			n = min_t(unsigned int, len - x,
+				  UDRM_CONV_CHUNK / sizeof(*src));
+			if (conv->begin)
+				conv->begin();
+			conv->rgb565(dst + x, src + x, n, swap);
+			if (conv->end)
+				conv->end();
+		}
+		dst += len;
+	}
+}
+
+static void udrm_conv_swab16(u16 *dst, void *vaddr, unsigned int pitch,
+			     const struct drm_clip_rect *clip, bool wc)
+{
+	const struct udrm_conv_funcs *conv = wc ? udrm_conv_wc : udrm_conv;
+	unsigned int len = clip->x2 - clip->x1;
+	unsigned int x, y, n;
+	u16 *src;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		src = vaddr + (y * pitch);
+		src += clip->x1;
+		for (x = 0; x < len; x += n) {
+			n = min_t(unsigned int, len - x,
+				  UDRM_CONV_CHUNK / sizeof(*src));
+			if (conv->begin)
+				conv->begin();
+			conv->swap16(dst + x, src + x, n);
+			if (conv->end)
+				conv->end();
+		}
+		dst += len;
+	}
+}
+
+/*
+ * Generic conversions go through XRGB8888. Each format has a read and a
+ * write helper, and a row function is generated for every src x dst pair
+ * so the helpers are inlined.
+ */
+#define UDRM_CPP_rgb565		2
+#define UDRM_CPP_bgr565		2
+#define UDRM_CPP_rgb888		3
+#define UDRM_CPP_bgr888		3
+#define UDRM_CPP_xrgb8888	4
+#define UDRM_CPP_xbgr8888	4
+#define UDRM_CPP_argb8888	4
+#define UDRM_CPP_abgr8888	4
+
+static inline u32 udrm_rgb565_to_xrgb(u16 v, bool bgr)
+{
+	u32 r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, b = v & 0x1f;
+
+	r = (r << 3) | (r >> 2);
+	g = (g << 2) | (g >> 4);
+	b = (b << 3) | (b >> 2);
+
+	return bgr ? (b << 16) | (g << 8) | r : (r << 16) | (g << 8) | b;
+}
+
+static inline u16 udrm_xrgb_to_rgb565(u32 v, bool bgr)
+{
+	u16 r = (v >> 19) & 0x1f, g = (v >> 10) & 0x3f, b = (v >> 3) & 0x1f;
+
+	return bgr ? (b << 11) | (g << 5) | r : (r << 11) | (g << 5) | b;
+}
+
+static inline u32 udrm_xrgb_swap_rb(u32 v)
+{
+	return ((v & 0xff) << 16) | (v & 0xff00) | ((v >> 16) & 0xff);
+}
+
+static inline u32 udrm_read_rgb565(const void *p)
+{
+	return udrm_rgb565_to_xrgb(*(const u16 *)p, false);
+}
+
+static inline u32 udrm_read_bgr565(const void *p)
+{
+	return udrm_rgb565_to_xrgb(*(const u16 *)p, true);
+}
+
+/* DRM_FORMAT_RGB888 is B, G, R in memory */
+static inline u32 udrm_read_rgb888(const void *p)
+{
+	const u8 *b = p;
+
+	return (b[2] << 16) | (b[1] << 8) | b[0];
+}
+
+static inline u32 udrm_read_bgr888(const void *p)
+{
+	const u8 *b = p;
+
+	return (b[0] << 16) | (b[1] << 8) | b[2];
+}
+
+static inline u32 udrm_read_xrgb8888(const void *p)
+{
+	return *(const u32 *)p & 0xffffff;
+}
+
+static inline u32 udrm_read_xbgr8888(const void *p)
+{
+	return udrm_xrgb_swap_rb(*(const u32 *)p);
+}
+
+/* Alpha is dropped */
+#define udrm_read_argb8888 udrm_read_xrgb8888
+#define udrm_read_abgr8888 udrm_read_xbgr8888
+
+static inline void udrm_write_rgb565(void *p, u32 v)
+{
+	*(u16 *)p = udrm_xrgb_to_rgb565(v, false);
+}
+
+static inline void udrm_write_bgr565(void *p, u32 v)
+{
+	*(u16 *)p = udrm_xrgb_to_rgb565(v, true);
+}
+
+static inline void udrm_write_rgb888(void *p, u32 v)
+{
+	u8 *b = p;
+
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+}
+
+static inline void udrm_write_bgr888(void *p, u32 v)
+{
+	u8 *b = p;
+
+	b[0] = v >> 16;
+	b[1] = v >> 8;
+	b[2] = v;
+}
+
+static inline void udrm_write_xrgb8888(void *p, u32 v)
+{
+	*(u32 *)p = v;
+}
+
+static inline void udrm_write_xbgr8888(void *p, u32 v)
+{
+	*(u32 *)p = udrm_xrgb_swap_rb(v);
+}
+
+typedef void (*udrm_conv_row_t)(void *dst, const void *src, unsigned int len);
+
+#define UDRM_CONV_ROW(s, d)						\
+static void udrm_conv_##s##_##d(void *dst, const void *src,		\
+				unsigned int len)			\
+{									\
+	unsigned int x;							\
+									\
+	for (x = 0; x < len; x++) {					\
+		udrm_write_##d(dst, udrm_read_##s(src));		\
+		src += UDRM_CPP_##s;					\
+		dst += UDRM_CPP_##d;					\
+	}								\
+}
+
+#define UDRM_CONV_ROWS(s)						\
+	UDRM_CONV_ROW(s, rgb565)					\
+	UDRM_CONV_ROW(s, bgr565)					\
+	UDRM_CONV_ROW(s, rgb888)					\
+	UDRM_CONV_ROW(s, bgr888)					\
+	UDRM_CONV_ROW(s, xrgb8888)					\
+	UDRM_CONV_ROW(s, xbgr8888)
+
+UDRM_CONV_ROWS(rgb565)
+UDRM_CONV_ROWS(bgr565)
+UDRM_CONV_ROWS(rgb888)
+UDRM_CONV_ROWS(bgr888)
+UDRM_CONV_ROWS(xrgb8888)
+UDRM_CONV_ROWS(xbgr8888)
+UDRM_CONV_ROWS(argb8888)
+UDRM_CONV_ROWS(abgr8888)
+
+#define UDRM_CONV_ENTRY(s) {						\
+	udrm_conv_##s##_rgb565, udrm_conv_##s##_bgr565,			\
+	udrm_conv_##s##_rgb888, udrm_conv_##s##_bgr888,			\
+	udrm_conv_##s##_xrgb8888, udrm_conv_##s##_xbgr8888,		\
+}
+
+/* The first UDRM_CONV_NUM_DST formats can also be transfer buffer formats */
+static const u32 udrm_conv_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_BGR565,
+	DRM_FORMAT_RGB888,
+	DRM_FORMAT_BGR888,
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_ABGR8888,
+};
+
+#define UDRM_CONV_NUM_DST	6
+
+static const udrm_conv_row_t
+udrm_conv_table[ARRAY_SIZE(udrm_conv_formats)][UDRM_CONV_NUM_DST] = {
+	UDRM_CONV_ENTRY(rgb565),
+	UDRM_CONV_ENTRY(bgr565),
+	UDRM_CONV_ENTRY(rgb888),
+	UDRM_CONV_ENTRY(bgr888),
+	UDRM_CONV_ENTRY(xrgb8888),
+	UDRM_CONV_ENTRY(xbgr8888),
+	UDRM_CONV_ENTRY(argb8888),
+	UDRM_CONV_ENTRY(abgr8888),
+};
+
+static int udrm_conv_format_index(u32 format, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		if (udrm_conv_formats[i] == format)
+			return i;
+
+	return -1;
+}
+
+static udrm_conv_row_t udrm_conv_lookup(u32 src_format, u32 dst_format)
+{
+	int s, d;
+
+	s = udrm_conv_format_index(src_format, ARRAY_SIZE(udrm_conv_formats));
+	d = udrm_conv_format_index(dst_format, UDRM_CONV_NUM_DST);
+	if (s < 0 || d < 0)
+		return NULL;
+
+	return udrm_conv_table[s][d];
+}
+
+bool udrm_conv_supported(u32 src_format, u32 dst_format)
+{
+	return src_format == dst_format ||
+	       udrm_conv_lookup(src_format, dst_format);
+}
+
+/* Reverse the bytes of each pixel in place */
+static void udrm_conv_swap_row(void *buf, unsigned int len, unsigned int cpp)
+{
+	unsigned int x;
+	u8 *b = buf;
+	u32 *p32 = buf;
+	u16 *p16 = buf;
+
+	switch (cpp) {
+	case 2:
+		for (x = 0; x < len; x++)
+			p16[x] = swab16(p16[x]);
+		break;
+	case 3:
+		for (x = 0; x < len; x++, b += 3)
+			swap(b[0], b[2]);
+		break;
+	case 4:
+		for (x = 0; x < len; x++)
+			p32[x] = swab32(p32[x]);
+		break;
+	}
+}
+
+/*
+ * Convert @clip in the framebuffer at @vaddr to @dst_format and pack it at
+ * @dst. @swap reverses the bytes of each destination pixel. @wc tells that
+ * the source is mapped write-combined.
+ */
+int udrm_conv_clip(void *dst, void *vaddr, unsigned int pitch,
+		   const struct drm_clip_rect *clip, u32 src_format,
+		   u32 dst_format, bool swap, bool wc)
+{
+	unsigned int src_cpp = drm_format_plane_cpp(src_format, 0);
+	unsigned int dst_cpp = drm_format_plane_cpp(dst_format, 0);
+	unsigned int len = clip->x2 - clip->x1;
+	udrm_conv_row_t row = NULL;
+	unsigned int y;
+	void *src;
+
+	if (src_format == dst_format) {
+		if (swap && dst_cpp == 2) {
+			udrm_conv_swab16(dst, vaddr, pitch, clip, wc);
+			return 0;
+		}
+	} else if (dst_format == DRM_FORMAT_RGB565 &&
+		   (src_format == DRM_FORMAT_XRGB8888 ||
+		    src_format == DRM_FORMAT_ARGB8888)) {
+		udrm_conv_xrgb8888_to_rgb565(dst, vaddr, pitch, clip, swap, wc);
+		return 0;
+	} else {
+		row = udrm_conv_lookup(src_format, dst_format);
+		if (!row)
+			return -EINVAL;
+	}
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		src = vaddr + (y * pitch) + (clip->x1 * src_cpp);
+		if (row)
+			row(dst, src, len);
+		else
+			memcpy(dst, src, len * dst_cpp);
+		if (swap)
+			udrm_conv_swap_row(dst, len, dst_cpp);
+		dst += len * dst_cpp;
+	}
+
+	return 0;
+}
+
+static const u8 udrm_bayer8[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/* BT.601 luma */
+static inline int udrm_xrgb_to_gray(u32 v)
+{
+	return (((v >> 16) & 0xff) * 77 + ((v >> 8) & 0xff) * 150 +
+		(v & 0xff) * 29) >> 8;
+}
+
+/*
+ * Convert @clip to packed grayscale with @bpp bits per pixel. @clip->x1
+ * must be on a byte boundary of the output. @line is scratch space for a
+ * row of XRGB8888 pixels and @err holds 2 * (width + 2) error terms for
+ * error diffusion.
+ */
+int udrm_conv_clip_gray(void *dst, void *vaddr, unsigned int pitch,
+			const struct drm_clip_rect *clip, u32 src_format,
+			unsigned int bpp, u32 dither, u32 *line, s16 *err)
+{
+	unsigned int src_cpp = drm_format_plane_cpp(src_format, 0);
+	unsigned int len = clip->x2 - clip->x1;
+	int max = (1 << bpp) - 1;
+	udrm_conv_row_t row = NULL;
+	unsigned int x, y, shift;
+	s16 *cur, *next;
+	const u32 *px;
+	u8 *out = dst;
+	int g, q, e;
+	u8 acc;
+
+	if (src_format != DRM_FORMAT_XRGB8888 &&
+	    src_format != DRM_FORMAT_ARGB8888) {
+		row = udrm_conv_lookup(src_format, DRM_FORMAT_XRGB8888);
+		if (!row)
+			return -EINVAL;
+	}
+
+	/* Error terms are kept 16x, with a spare entry at each end */
+	cur = err + 1;
+	next = err + len + 3;
+	if (dither & UDRM_BUF_MODE_DITHER_DIFFUSION)
+		memset(err, 0, 2 * (len + 2) * sizeof(*err));
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		px = vaddr + (y * pitch) + (clip->x1 * src_cpp);
+		if (row) {
+			row(line, px, len);
+			px = line;
+		}
+
+		acc = 0;
+		shift = 8;
+		for (x = 0; x < len; x++) {
+			g = udrm_xrgb_to_gray(px[x]);
+
+			if (dither & UDRM_BUF_MODE_DITHER_ORDERED) {
+				e = udrm_bayer8[y & 7][(clip->x1 + x) & 7];
+				q = (g * max + (e * 255 + 32) / 64) / 255;
+			} else if (dither & UDRM_BUF_MODE_DITHER_DIFFUSION) {
+				g = clamp(g + cur[x] / 16, 0, 255);
+				q = (g * max + 127) / 255;
+				e = g - q * 255 / max;
+				cur[x + 1] += e * 7;
+				next[x - 1] += e * 3;
+				next[x] += e * 5;
+				next[x + 1] += e;
+			} else {
+				q = (g * max + 127) / 255;
+			}
+
+			shift -= bpp;
+			acc |= q << shift;
+			if (!shift) {
+				*out++ = acc;
+				acc = 0;
+				shift = 8;
+			}
+		}
+		if (shift != 8)
+			*out++ = acc;
+
+		if (dither & UDRM_BUF_MODE_DITHER_DIFFUSION) {
+			swap(cur, next);
+			memset(next - 1, 0, (len + 2) * sizeof(*err));
+		}
+	}
+
+	return 0;
+}
+
+static bool udrm_rle_same(const u8 *a, const u8 *b, unsigned int cpp)
+{
+	switch (cpp) {
+	case 1:
+		return *a == *b;
+	case 2:
+		return get_unaligned((const u16 *)a) ==
+		       get_unaligned((const u16 *)b);
+	case 4:
+		return get_unaligned((const u32 *)a) ==
+		       get_unaligned((const u32 *)b);
+	default:
+		return !memcmp(a, b, cpp);
+	}
+}
+
+/*
+ * Run length encode @src_len bytes of @cpp byte pixels into @dst, see
+ * UDRM_BUF_MODE_RLE. Returns the encoded length or zero if it didn't fit.
+ */
+size_t udrm_conv_rle(void *dst, size_t dst_len, const void *src,
+		     size_t src_len, unsigned int cpp)
+{
+	const u8 *in = src, *end = src + src_len;
+	u8 *out = dst, *out_end = dst + dst_len;
+	unsigned int n;
+
+	while (end - in >= cpp) {
+		for (n = 1; n < 128 && end - in >= (n + 1) * cpp; n++)
+			if (!udrm_rle_same(in, in + n * cpp, cpp))
+				break;
+
+		if (n > 1) {
+			if (out_end - out < 1 + cpp)
+				return 0;
+			*out++ = 0x80 | (n - 1);
+			memcpy(out, in, cpp);
+			out += cpp;
+			in += n * cpp;
+			continue;
+		}
+
+		/* Literals until the next run of two */
+		for (n = 1; n < 128 && end - in >= (n + 1) * cpp; n++)
+			if (end - in >= (n + 2) * cpp &&
+			    udrm_rle_same(in + n * cpp, in + (n + 1) * cpp, cpp))
+				break;
+
+		if (out_end - out < 1 + n * cpp)
+			return 0;
+		*out++ = n - 1;
+		memcpy(out, in, n * cpp);
+		out += n * cpp;
+		in += n * cpp;
+	}
+
+	return out - (u8 *)dst;
+}
+
+/*
+ * XOR each row with the one above it in place, bottom up. @undo goes top
+ * down to get the rows back.
+ */
+void udrm_conv_row_delta(void *vaddr, size_t pitch, unsigned int rows,
+			 bool undo)
+{
+	unsigned int y;
+	u8 *row, *prev;
+	size_t i;
+
+	for (y = 1; y < rows; y++) {
+		row = vaddr + (undo ? y : rows - y) * pitch;
+		prev = row - pitch;
+		for (i = 0; i < pitch; i++)
+			row[i] ^= prev[i];
+	}
+}
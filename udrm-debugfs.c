@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <drm/drmP.h>
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+#include <uapi/drm/udrm.h>
+
+#include "udrm.h"
+
+/*
+ * The counters are per-CPU so collecting them is cheap enough to always be
+ * on. They're summed up when read from debugfs: dri/<minor>/udrm/stats,
+ * and writing anything to dri/<minor>/udrm/reset clears them.
+ */
+
+static const char * const udrm_stats_event_names[UDRM_STATS_EVENT_TYPES] = {
+	[UDRM_EVENT_PIPE_ENABLE]	= "pipe_enable",
+	[UDRM_EVENT_PIPE_DISABLE]	= "pipe_disable",
+	[UDRM_EVENT_FB_CREATE]		= "fb_create",
+	[UDRM_EVENT_FB_DESTROY]		= "fb_destroy",
+	[UDRM_EVENT_FB_DIRTY]		= "fb_dirty",
+	[UDRM_EVENT_FB_COPY]		= "fb_copy",
+	[UDRM_EVENT_FB_FILL]		= "fb_fill",
+};
+
+/* Bucket i counts durations below 2^i microseconds, the last one the rest */
+static unsigned int udrm_stats_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return min_t(unsigned int, us ? ilog2(us) + 1 : 0,
+		     UDRM_STATS_HIST_BUCKETS - 1);
+}
+
+void udrm_stats_event(struct udrm_device *udev, u32 type, u64 ns)
+{
+	struct udrm_stats *stats = udev->stats;
+
+	if (type >= UDRM_STATS_EVENT_TYPES)
+		type = 0;
+
+	this_cpu_inc(stats->events[type]);
+	this_cpu_add(stats->event_ns[type], ns);
+	this_cpu_inc(stats->event_hist[type][udrm_stats_bucket(ns)]);
+}
+
+void udrm_stats_copy(struct udrm_device *udev, u64 pixels, u64 bytes, u64 ns)
+{
+	struct udrm_stats *stats = udev->stats;
+
+	this_cpu_add(stats->copy_pixels, pixels);
+	this_cpu_add(stats->copy_bytes, bytes);
+	this_cpu_add(stats->copy_ns, ns);
+	this_cpu_inc(stats->copy_hist[udrm_stats_bucket(ns)]);
+}
+
+int udrm_stats_init(struct udrm_device *udev)
+{
+	udev->stats = alloc_percpu(struct udrm_stats);
+	if (!udev->stats)
+		return -ENOMEM;
+
+	udev->stats_reset = ktime_get();
+
+	return 0;
+}
+
+void udrm_stats_fini(struct udrm_device *udev)
+{
+	free_percpu(udev->stats);
+	udev->stats = NULL;
+}
+
+static void udrm_stats_sum(struct udrm_device *udev, struct udrm_stats *sum)
+{
+	struct udrm_stats *stats;
+	unsigned int i, j;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(udev->stats, cpu);
+
+		for (i = 0; i < UDRM_STATS_EVENT_TYPES; i++) {
+			sum->events[i] += stats->events[i];
+			sum->event_ns[i] += stats->event_ns[i];
+			for (j = 0; j < UDRM_STATS_HIST_BUCKETS; j++)
+				sum->event_hist[i][j] += stats->event_hist[i][j];
+		}
+		sum->event_timeouts += stats->event_timeouts;
+		sum->flushes += stats->flushes;
+		sum->flushes_coalesced += stats->flushes_coalesced;
+		sum->flushes_dropped += stats->flushes_dropped;
+		sum->copy_pixels += stats->copy_pixels;
+		sum->copy_bytes += stats->copy_bytes;
+		sum->copy_ns += stats->copy_ns;
+		for (j = 0; j < UDRM_STATS_HIST_BUCKETS; j++)
+			sum->copy_hist[j] += stats->copy_hist[j];
+	}
+}
+
+static void udrm_stats_print_hist(struct seq_file *m, const u64 *hist)
+{
+	unsigned int i;
+
+	for (i = 0; i < UDRM_STATS_HIST_BUCKETS; i++)
+		seq_printf(m, " %llu", hist[i]);
+	seq_putc(m, '\n');
+}
+
+static int udrm_stats_show(struct seq_file *m, void *arg)
+{
+	struct udrm_device *udev = m->private;
+	struct udrm_stats *sum;
+	u64 elapsed_ms;
+	unsigned int i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	udrm_stats_sum(udev, sum);
+	elapsed_ms = ktime_ms_delta(ktime_get(), udev->stats_reset) ?: 1;
+
+	seq_printf(m, "buf_mode: 0x%x\n", udev->buf_mode);
+	seq_printf(m, "seconds: %llu\n", div_u64(elapsed_ms, MSEC_PER_SEC));
+	seq_printf(m, "flushes: %llu\n", sum->flushes);
+	seq_printf(m, "flushes_per_sec: %llu\n",
+		   div64_u64(sum->flushes * MSEC_PER_SEC, elapsed_ms));
+	seq_printf(m, "flushes_coalesced: %llu\n", sum->flushes_coalesced);
+	seq_printf(m, "flushes_dropped: %llu\n", sum->flushes_dropped);
+	seq_printf(m, "copy_pixels: %llu\n", sum->copy_pixels);
+	seq_printf(m, "copy_bytes: %llu\n", sum->copy_bytes);
+	seq_printf(m, "copy_us: %llu\n", div_u64(sum->copy_ns, NSEC_PER_USEC));
+	seq_puts(m, "copy_hist_us:");
+	udrm_stats_print_hist(m, sum->copy_hist);
+	seq_printf(m, "event_timeouts: %llu\n", sum->event_timeouts);
+
+	for (i = 0; i < UDRM_STATS_EVENT_TYPES; i++) {
+		if (!sum->events[i])
+			continue;
+		seq_printf(m, "event_%s: count=%llu avg_us=%llu hist_us:",
+			   udrm_stats_event_names[i] ?: "unknown",
+			   sum->events[i],
+			   div64_u64(sum->event_ns[i],
+				     sum->events[i] * NSEC_PER_USEC));
+		udrm_stats_print_hist(m, sum->event_hist[i]);
+	}
+
+	kfree(sum);
+
+	return 0;
+}
+
+static int udrm_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, udrm_stats_show, inode->i_private);
+}
+
+static const struct file_operations udrm_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= udrm_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t udrm_stats_reset_write(struct file *file,
+				      const char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct udrm_device *udev = file->private_data;
+	int cpu;
+
+	/* Racing updates can survive a reset, that's fine for statistics */
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(udev->stats, cpu), 0,
+		       sizeof(struct udrm_stats));
+	udev->stats_reset = ktime_get();
+
+	return count;
+}
+
+static const struct file_operations udrm_stats_reset_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.write		= udrm_stats_reset_write,
+	.llseek		= no_llseek,
+};
+
+int udrm_debugfs_init(struct drm_minor *minor)
+{
+	struct udrm_device *udev = drm_to_udrm(minor->dev);
+	struct dentry *dir;
+
+	if (minor->type != DRM_MINOR_PRIMARY)
+		return 0;
+
+	dir = debugfs_create_dir("udrm", minor->debugfs_root);
+	if (!dir)
+		return -ENOMEM;
+
+	if (!debugfs_create_file("stats", 0444, dir, udev,
+				 &udrm_stats_fops) ||
+	    !debugfs_create_file("reset", 0200, dir, udev,
+				 &udrm_stats_reset_fops)) {
+		debugfs_remove_recursive(dir);
+		return -ENOMEM;
+	}
+
+	udev->debugfs = dir;
+
+	return 0;
+}
+
+void udrm_debugfs_cleanup(struct drm_minor *minor)
+{
+	struct udrm_device *udev = drm_to_udrm(minor->dev);
+
+	if (minor->type != DRM_MINOR_PRIMARY)
+		return;
+
+	debugfs_remove_recursive(udev->debugfs);
+	udev->debugfs = NULL;
+}
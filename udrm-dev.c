@@ -9,88 +9,434 @@
 
 #include <linux/completion.h>
 #include <linux/dma-buf.h>
+#include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/idr.h>
 #include <linux/init.h>
+#include <linux/kref.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include <uapi/drm/udrm.h>
 
 #include "udrm.h"
 
+#define CREATE_TRACE_POINTS
+#include "udrm-trace.h"
+
 static struct miscdevice udrm_misc;
 
-int udrm_send_event(struct udrm_device *udev, void *ev_in)
+/*
+ * Registered devices, so UDRM_DEV_ATTACH can find the persistent ones that
+ * have been left detached. The lock also serializes creating and attaching
+ * with closing.
+ */
+static LIST_HEAD(udrm_devices);
+static DEFINE_MUTEX(udrm_devices_lock);
+
+#define UDRM_EVENT_TIMEOUT	(5 * HZ)
+#define UDRM_DEFAULT_QUEUE_DEPTH	4
+
+struct udrm_pending_event {
+	struct list_head list;
+	struct kref ref;
+	struct completion completion;
+	bool queued;
+	int ret;
+	struct udrm_event_reply reply;
+	struct udrm_device *pool;
+	struct dma_buf *dmabuf;
+	struct udrm_event *ev;
+};
+
+/*
+ * Events up to UDRM_EVENT_MAX_SIZE come from a per-device pool so sending
+ * doesn't allocate. Larger events and overflow fall back to kmalloc.
+ */
+#define UDRM_EVENT_POOL_ENTRY_SIZE \
+	ALIGN(sizeof(struct udrm_pending_event) + UDRM_EVENT_MAX_SIZE, 8)
+
+static int udrm_event_pool_alloc(struct udrm_device *udev)
 {
-	struct udrm_event *ev = ev_in;
-	unsigned long time_left;
-	int ret = 0;
+	struct udrm_pending_event *pev;
+	unsigned int i, num = 2 * udev->ev_depth;
 
-	mutex_lock(&udev->dev_lock);
+	INIT_LIST_HEAD(&udev->ev_pool);
+	udev->ev_pool_mem = kcalloc(num, UDRM_EVENT_POOL_ENTRY_SIZE,
+				    GFP_KERNEL);
+	if (!udev->ev_pool_mem)
+		return -ENOMEM;
 
-	DRM_DEBUG("IN ev->type=%u, ev->length=%u\n", ev->type, ev->length);
+	for (i = 0; i < num; i++) {
+		pev = udev->ev_pool_mem + i * UDRM_EVENT_POOL_ENTRY_SIZE;
+		pev->pool = udev;
+		list_add_tail(&pev->list, &udev->ev_pool);
+	}
 
-	if (!udev->initialized) {
-		DRM_ERROR("Not initialized\n");
-		ret = -ENODEV;
-		goto out_unlock;
+	return 0;
+}
+
+/* Only for a failed DEV_CREATE, the pool is in use until teardown otherwise */
+static void udrm_event_pool_free(struct udrm_device *udev)
+{
+	kfree(udev->ev_pool_mem);
+	udev->ev_pool_mem = NULL;
+	INIT_LIST_HEAD(&udev->ev_pool);
+}
+
+static struct udrm_pending_event *
+udrm_pending_event_alloc(struct udrm_device *udev, size_t len)
+{
+	struct udrm_pending_event *pev = NULL;
+
+	if (len <= UDRM_EVENT_MAX_SIZE) {
+		spin_lock(&udev->ev_pool_lock);
+		pev = list_first_entry_or_null(&udev->ev_pool,
+					       struct udrm_pending_event, list);
+		if (pev)
+			list_del(&pev->list);
+		spin_unlock(&udev->ev_pool_lock);
 	}
 
-	ev = kmemdup(ev, ev->length, GFP_KERNEL);
-	if (!ev) {
-		ret = -ENOMEM;
-		goto out_unlock;
+	if (!pev) {
+		pev = kmalloc(sizeof(*pev) + len, GFP_KERNEL);
+		if (!pev)
+			return NULL;
+		pev->pool = NULL;
 	}
 
-	reinit_completion(&udev->completion);
+	pev->ev = (struct udrm_event *)(pev + 1);
 
-	ret = mutex_lock_interruptible(&udev->mutex);
-	if (ret) {
-		kfree(ev);
-		goto out_unlock;
+	return pev;
+}
+
+static void udrm_pending_event_free(struct kref *ref)
+{
+	struct udrm_pending_event *pev;
+	struct udrm_device *udev;
+
+	pev = container_of(ref, struct udrm_pending_event, ref);
+	if (pev->dmabuf)
+		dma_buf_put(pev->dmabuf);
+
+	udev = pev->pool;
+	if (!udev) {
+		kfree(pev);
+		return;
 	}
-	udev->ev = ev;
-	mutex_unlock(&udev->mutex);
 
-	wake_up_interruptible(&udev->waitq);
+	spin_lock(&udev->ev_pool_lock);
+	list_add(&pev->list, &udev->ev_pool);
+	spin_unlock(&udev->ev_pool_lock);
+}
 
-	time_left = wait_for_completion_timeout(&udev->completion, 5 * HZ);
-	ret = udev->event_ret;
-	if (!time_left) {
-		DRM_ERROR("timeout waiting for reply\n");
-		ret = -ETIMEDOUT;
+/* Must be called with ev_lock held */
+static void udrm_event_done(struct udrm_device *udev,
+			    struct udrm_pending_event *pev, int ret)
+{
+	list_del(&pev->list);
+	udev->ev_count--;
+	pev->ret = ret;
+	complete(&pev->completion);
+	wake_up(&udev->space_waitq);
+	kref_put(&pev->ref, udrm_pending_event_free);
+}
+
+/* Replies come from write() and from the ring, check them the same way */
+static bool udrm_reply_valid(const struct udrm_event_reply *reply)
+{
+	return !(reply->flags & ~(UDRM_REPLY_TIMESTAMP |
+				  UDRM_REPLY_BUF_RETAIN));
+}
+
+/* Must be called with ev_lock held */
+static int udrm_reply_event_locked(struct udrm_device *udev,
+				   struct udrm_event_reply *reply)
+{
+	struct udrm_pending_event *pev;
+
+	if (!udrm_reply_valid(reply)) {
+		DRM_DEBUG("Invalid reply flags=0x%x seq=%u\n", reply->flags,
+			  reply->seq);
+		return -EINVAL;
 	}
 
-out_unlock:
-	mutex_unlock(&udev->dev_lock);
+	list_for_each_entry(pev, &udev->ev_sent, list) {
+		if (pev->ev->seq == reply->seq) {
+			trace_udrm_event_reply(udev, pev->ev, reply->ret);
+			pev->reply = *reply;
+			udrm_event_done(udev, pev, reply->ret);
+			return 0;
+		}
+	}
 
-	DRM_DEBUG("OUT ret=%d, event_ret=%d\n", ret, udev->event_ret);
+	DRM_DEBUG("No event waiting for seq=%u\n", reply->seq);
 
-	return ret;
+	return -EINVAL;
+}
+
+/*
+ * The ring header is writable by userspace, so the layout is always computed
+ * from the kernel's own copy of the number of entries.
+ */
+static size_t udrm_ring_sq_offset(void)
+{
+	return ALIGN(sizeof(struct udrm_ring), L1_CACHE_BYTES);
 }
 
-static void udrm_release_work(struct work_struct *work)
+static size_t udrm_ring_cq_offset(unsigned int num_entries)
 {
-	struct udrm_device *udev = container_of(work, struct udrm_device,
-						    release_work);
-	struct drm_device *drm = &udev->drm;
+	return udrm_ring_sq_offset() + num_entries * UDRM_RING_SQ_ENTRY_SIZE;
+}
 
-	//drm_device_set_unplugged(drm);
+static void *udrm_ring_sq_entry(struct udrm_device *udev, u32 index)
+{
+	index &= udev->ring_entries - 1;
 
-	udev->initialized = false;
-	udev->event_ret = -ENODEV;
-	complete(&udev->completion);
+	return (void *)udev->ring + udrm_ring_sq_offset() +
+	       index * UDRM_RING_SQ_ENTRY_SIZE;
+}
+
+/*
+ * Must be called with ev_lock held. The entry of an event that timed out is
+ * only free once userspace has moved sq_head past it.
+ */
+static bool udrm_ring_space(struct udrm_device *udev)
+{
+	return udev->ring_sq_tail - READ_ONCE(udev->ring->sq_head) <
+	       udev->ring_entries;
+}
 
-	while (drm->open_count) {
-		DRM_DEBUG_KMS("open_count=%d\n", drm->open_count);
-		msleep(1000);
+/* Must be called with ev_lock held */
+static void udrm_ring_submit(struct udrm_device *udev,
+			     struct udrm_pending_event *pev)
+{
+	struct udrm_ring *ring = udev->ring;
+	u32 tail = udev->ring_sq_tail;
+
+	memcpy(udrm_ring_sq_entry(udev, tail), pev->ev, pev->ev->length);
+	list_add_tail(&pev->list, &udev->ev_sent);
+	udev->ring_sq_tail = tail + 1;
+	smp_store_release(&ring->sq_tail, udev->ring_sq_tail);
+
+	/* Userspace only sleeps when it has seen an empty queue */
+	if (READ_ONCE(ring->sq_head) == tail)
+		wake_up_interruptible(&udev->waitq);
+}
+
+/* Must be called with ev_lock held. Submit the events waiting for space. */
+static void udrm_ring_submit_queued(struct udrm_device *udev)
+{
+	struct udrm_pending_event *pev, *tmp;
+
+	list_for_each_entry_safe(pev, tmp, &udev->ev_queue, list) {
+		if (!udrm_ring_space(udev))
+			break;
+		list_del(&pev->list);
+		udrm_ring_submit(udev, pev);
 	}
+}
+
+/* Must be called with ev_lock held */
+static void udrm_ring_reap(struct udrm_device *udev)
+{
+	struct udrm_ring *ring = udev->ring;
+	struct udrm_event_reply *cq;
+	u32 mask = udev->ring_entries - 1;
+	u32 head = udev->ring_cq_head;
+	u32 tail = smp_load_acquire(&ring->cq_tail);
+	struct udrm_event_reply reply;
+
+	cq = (void *)ring + udrm_ring_cq_offset(udev->ring_entries);
+
+	if (tail - head > udev->ring_entries) {
+		DRM_DEBUG("Bogus completion queue tail=%u head=%u\n",
+			  tail, head);
+		head = tail;
+	}
+
+	for (; head != tail; head++) {
+		reply = cq[head & mask];
+		udrm_reply_event_locked(udev, &reply);
+	}
+
+	udev->ring_cq_head = head;
+	smp_store_release(&ring->cq_head, head);
+
+	udrm_ring_submit_queued(udev);
+}
+
+static int udrm_ring_alloc(struct udrm_device *udev)
+{
+	unsigned int num_entries = roundup_pow_of_two(udev->ev_depth);
+	struct udrm_ring *ring;
+	size_t size;
+
+	BUILD_BUG_ON(UDRM_EVENT_MAX_SIZE > UDRM_RING_SQ_ENTRY_SIZE);
+
+	size = PAGE_ALIGN(udrm_ring_cq_offset(num_entries) +
+			  num_entries * sizeof(struct udrm_event_reply));
+
+	ring = vmalloc_user(size);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->num_entries = num_entries;
+	ring->sq_entry_size = UDRM_RING_SQ_ENTRY_SIZE;
+	ring->sq_offset = udrm_ring_sq_offset();
+	ring->cq_offset = udrm_ring_cq_offset(num_entries);
+
+	udev->ring = ring;
+	udev->ring_entries = num_entries;
+	udev->ring_size = size;
+	udev->ring_sq_tail = 0;
+	udev->ring_cq_head = 0;
 
-	udrm_drm_unregister(udev);
+	return 0;
+}
+
+static void udrm_ring_free(struct udrm_device *udev)
+{
+	vfree(udev->ring);
+	udev->ring = NULL;
+}
+
+/* Returns true if the event was queued or the device has gone away */
+static bool udrm_queue_event(struct udrm_device *udev,
+			     struct udrm_pending_event *pev)
+{
+	bool done = true;
+
+	spin_lock(&udev->ev_lock);
+	if (!udev->initialized) {
+		pev->ret = -ENODEV;
+	} else if (udev->ev_count < udev->ev_depth) {
+		pev->ev->seq = ++udev->ev_seq;
+		trace_udrm_event_queue(udev, pev->ev);
+		kref_get(&pev->ref);
+		udev->ev_count++;
+		pev->queued = true;
+		list_add_tail(&pev->list, &udev->ev_queue);
+		if (udev->ring)
+			udrm_ring_submit_queued(udev);
+		else
+			wake_up_interruptible(&udev->waitq);
+	} else {
+		done = false;
+	}
+	spin_unlock(&udev->ev_lock);
+
+	return done;
+}
+
+/*
+ * Send an event and wait for the reply. If it succeeds and @reply is set,
+ * it's filled in with the reply from userspace. @dmabuf is installed as an
+ * fd when the event is read, see struct udrm_event_fb.
+ */
+static int __udrm_send_event(struct udrm_device *udev, void *ev_in,
+			     struct dma_buf *dmabuf,
+			     struct udrm_event_reply *reply)
+{
+	struct udrm_event *ev = ev_in;
+	struct udrm_pending_event *pev;
+	unsigned long time_left;
+	ktime_t start;
+	int ret;
+
+	DRM_DEBUG("IN ev->type=%u, ev->length=%u\n", ev->type, ev->length);
+
+	if (!udev->initialized) {
+		/* The state is replayed to the next driver that attaches */
+		if (!udev->detached)
+			DRM_ERROR("Not initialized\n");
+		return -ENODEV;
+	}
+
+	if (udev->ring && WARN_ON(ev->length > UDRM_RING_SQ_ENTRY_SIZE))
+		return -E2BIG;
+
+	pev = udrm_pending_event_alloc(udev, ev->length);
+	if (!pev)
+		return -ENOMEM;
+
+	kref_init(&pev->ref);
+	init_completion(&pev->completion);
+	pev->queued = false;
+	pev->ret = -ETIMEDOUT;
+	memset(&pev->reply, 0, sizeof(pev->reply));
+	memcpy(pev->ev, ev, ev->length);
+	pev->dmabuf = dmabuf;
+	if (dmabuf)
+		get_dma_buf(dmabuf);
+
+	start = ktime_get();
+	time_left = wait_event_timeout(udev->space_waitq,
+				       udrm_queue_event(udev, pev),
+				       UDRM_EVENT_TIMEOUT);
+	if (time_left && pev->queued)
+		wait_for_completion_timeout(&pev->completion, time_left);
+
+	spin_lock(&udev->ev_lock);
+	if (pev->queued && !completion_done(&pev->completion))
+		udrm_event_done(udev, pev, -ETIMEDOUT);
+	ret = pev->ret;
+	if (!ret && reply)
+		*reply = pev->reply;
+	spin_unlock(&udev->ev_lock);
+
+	if (!ret)
+		udrm_stats_event(udev, ev->type,
+				 ktime_to_ns(ktime_sub(ktime_get(), start)));
+	else if (ret == -ETIMEDOUT)
+		udrm_stats_inc(udev, event_timeouts);
+
+	if (ret == -ETIMEDOUT)
+		DRM_ERROR("timeout waiting for reply\n");
+
+	DRM_DEBUG("OUT ret=%d, seq=%u\n", ret, pev->ev->seq);
+
+	kref_put(&pev->ref, udrm_pending_event_free);
+
+	return ret;
+}
+
+int udrm_send_event_reply(struct udrm_device *udev, void *ev_in,
+			  struct udrm_event_reply *reply)
+{
+	return __udrm_send_event(udev, ev_in, NULL, reply);
+}
+
+int udrm_send_event_dmabuf(struct udrm_device *udev, void *ev_in,
+			   struct dma_buf *dmabuf)
+{
+	if (WARN_ON(dmabuf && udev->ring))
+		return -EINVAL;
+
+	return __udrm_send_event(udev, ev_in, dmabuf, NULL);
+}
+
+int udrm_send_event(struct udrm_device *udev, void *ev_in)
+{
+	return __udrm_send_event(udev, ev_in, NULL, NULL);
+}
+
+static void udrm_cancel_events(struct udrm_device *udev)
+{
+	struct udrm_pending_event *pev, *tmp;
+
+	spin_lock(&udev->ev_lock);
+	udev->initialized = false;
+	list_for_each_entry_safe(pev, tmp, &udev->ev_queue, list)
+		udrm_event_done(udev, pev, -ENODEV);
+	list_for_each_entry_safe(pev, tmp, &udev->ev_sent, list)
+		udrm_event_done(udev, pev, -ENODEV);
+	spin_unlock(&udev->ev_lock);
 }
 
 static int udrm_open(struct inode *inode, struct file *file)
@@ -101,11 +447,14 @@ static int udrm_open(struct inode *inode, struct file *file)
 	if (!udev)
 		return -ENOMEM;
 
-	mutex_init(&udev->mutex);
+	spin_lock_init(&udev->ev_lock);
 	init_waitqueue_head(&udev->waitq);
-	init_completion(&udev->completion);
+	init_waitqueue_head(&udev->space_waitq);
+	INIT_LIST_HEAD(&udev->ev_queue);
+	INIT_LIST_HEAD(&udev->ev_sent);
+	spin_lock_init(&udev->ev_pool_lock);
+	INIT_LIST_HEAD(&udev->ev_pool);
 	idr_init(&udev->idr);
-	INIT_WORK(&udev->release_work, udrm_release_work);
 
 	file->private_data = udev;
 	nonseekable_open(inode, file);
@@ -113,11 +462,25 @@ static int udrm_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static int udrm_reply_event(struct udrm_device *udev,
+			    struct udrm_event_reply *reply)
+{
+	int ret;
+
+	spin_lock(&udev->ev_lock);
+	ret = udrm_reply_event_locked(udev, reply);
+	spin_unlock(&udev->ev_lock);
+
+	return ret;
+}
+
 static ssize_t udrm_write(struct file *file, const char __user *buffer,
 			   size_t count, loff_t *ppos)
 {
 	struct udrm_device *udev = file->private_data;
-	int ret, event_ret;
+	struct udrm_event_reply reply;
+	size_t done;
+	int ret;
 
 	if (!udev->initialized)
 		return -EINVAL;
@@ -125,59 +488,94 @@ static ssize_t udrm_write(struct file *file, const char __user *buffer,
 	if (!count)
 		return 0;
 
-	if (count != sizeof(int))
+	if (count % sizeof(reply))
 		return -EINVAL;
 
-	if (copy_from_user(&event_ret, buffer, sizeof(int)))
-		return -EFAULT;
-
-	ret = mutex_lock_interruptible(&udev->mutex);
-	if (ret)
-		return ret;
-
-	udev->event_ret = event_ret;
-	complete(&udev->completion);
+	for (done = 0; done < count; done += sizeof(reply)) {
+		if (copy_from_user(&reply, buffer + done, sizeof(reply))) {
+			ret = -EFAULT;
+			break;
+		}
 
-	mutex_unlock(&udev->mutex);
+		ret = udrm_reply_event(udev, &reply);
+		if (ret)
+			break;
+	}
 
-	return count;
+	return done ? done : ret;
 }
 
 static ssize_t udrm_read(struct file *file, char __user *buffer, size_t count,
 			  loff_t *ppos)
 {
 	struct udrm_device *udev = file->private_data;
+	struct udrm_pending_event *pev;
+	int fd = -1;
 	ssize_t ret;
 
 	if (!count)
 		return 0;
 
-	do {
-		ret = mutex_lock_interruptible(&udev->mutex);
-		if (ret)
-			return ret;
+	if (udev->ring)
+		return -EINVAL;
 
-		if (!udev->ev && (file->f_flags & O_NONBLOCK)) {
+	while (true) {
+		spin_lock(&udev->ev_lock);
+		pev = list_first_entry_or_null(&udev->ev_queue,
+					       struct udrm_pending_event, list);
+		if (pev && count < pev->ev->length) {
+			ret = -EINVAL;
+			pev = NULL;
+		} else if (pev) {
+			list_move_tail(&pev->list, &udev->ev_sent);
+			kref_get(&pev->ref);
+		} else if (file->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
-		} else if (udev->ev) {
-			if (count < udev->ev->length)
-				ret = -EINVAL;
-			else if (copy_to_user(buffer, udev->ev, udev->ev->length))
-				ret = -EFAULT;
-			else
-				ret = udev->ev->length;
-			kfree(udev->ev);
-			udev->ev = NULL;
+		} else {
+			ret = 0;
 		}
+		spin_unlock(&udev->ev_lock);
 
-		mutex_unlock(&udev->mutex);
+		if (pev)
+			break;
 
+		if (!ret)
+			ret = wait_event_interruptible(udev->waitq,
+					!list_empty(&udev->ev_queue));
 		if (ret)
-			break;
+			return ret;
+	}
+
+	/* The event is only read once, so it can be patched in place */
+	ret = 0;
+	if (pev->dmabuf) {
+		fd = get_unused_fd_flags(O_CLOEXEC);
+		if (fd < 0)
+			ret = fd;
+		else
+			((struct udrm_event_fb *)pev->ev)->buf_fd = fd;
+	}
 
-		if (!(file->f_flags & O_NONBLOCK))
-			ret = wait_event_interruptible(udev->waitq, udev->ev);
-	} while (ret == 0);
+	if (!ret && copy_to_user(buffer, pev->ev, pev->ev->length))
+		ret = -EFAULT;
+
+	if (ret) {
+		spin_lock(&udev->ev_lock);
+		if (!completion_done(&pev->completion))
+			udrm_event_done(udev, pev, ret);
+		spin_unlock(&udev->ev_lock);
+		if (fd >= 0)
+			put_unused_fd(fd);
+	} else {
+		if (fd >= 0) {
+			get_dma_buf(pev->dmabuf);
+			fd_install(fd, pev->dmabuf->file);
+		}
+		trace_udrm_event_read(udev, pev->ev);
+		ret = pev->ev->length;
+	}
+
+	kref_put(&pev->ref, udrm_pending_event_free);
 
 	return ret;
 }
@@ -188,56 +586,288 @@ static unsigned int udrm_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &udev->waitq, wait);
 
-	if (udev->ev)
+	if (udev->ring) {
+		bool pending;
+
+		spin_lock(&udev->ev_lock);
+		if (udev->initialized)
+			udrm_ring_reap(udev);
+		pending = READ_ONCE(udev->ring->sq_head) != udev->ring_sq_tail;
+		spin_unlock(&udev->ev_lock);
+
+		return pending ? POLLIN | POLLRDNORM : 0;
+	}
+
+	if (!list_empty(&udev->ev_queue))
 		return POLLIN | POLLRDNORM;
 
 	return 0;
 }
 
+static int udrm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct udrm_device *udev = file->private_data;
+
+	if (!udev->ring || vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > udev->ring_size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, udev->ring, 0);
+}
+
+static void udrm_stub_free(struct udrm_device *udev)
+{
+	idr_destroy(&udev->idr);
+	kfree(udev);
+}
+
 static int udrm_release(struct inode *inode, struct file *file)
 {
 	struct udrm_device *udev = file->private_data;
+	struct udrm_device *stub = udev->stub;
+
+	mutex_lock(&udrm_devices_lock);
+	udev->stub = NULL;
+
+	if (udev->initialized && (udev->flags & UDRM_DEV_FLAG_PERSIST)) {
+		/* Keep the DRM device for the next driver to attach */
+		udev->detached = true;
+		udrm_cancel_events(udev);
+		udrm_ring_free(udev);
+		udrm_drm_detach(udev);
+	} else if (udev->initialized) {
+		list_del(&udev->node);
+		/* Pending and future events fail with -ENODEV from here on */
+		udrm_cancel_events(udev);
+		udrm_ring_free(udev);
+		/* udev is torn down now or when the last DRM file is closed */
+		udrm_drm_unregister(udev);
+	} else if (udev->drm_initialized) {
+		/* DEV_CREATE failed after the DRM device was set up */
+		drm_dev_unref(&udev->drm);
+	} else {
+		udrm_stub_free(udev);
+	}
+
+	mutex_unlock(&udrm_devices_lock);
 
-	if (udev->initialized)
-		schedule_work(&udev->release_work);
+	if (stub)
+		udrm_stub_free(stub);
 
 	return 0;
 }
 
-static long udrm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static int udrm_dev_create(struct udrm_device *udev, void __user *arg)
 {
-	struct udrm_device *udev = file->private_data;
 	struct udrm_dev_create dev_create;
 	uint32_t *formats;
 	int ret;
 
-	switch (cmd) {
-	case UDRM_DEV_CREATE:
-		if (copy_from_user(&dev_create, (void __user *)arg,
-				   sizeof(dev_create)))
-			return -EFAULT;
+	if (udev->initialized || udev->drm_initialized)
+		return -EBUSY;
 
-		if (!dev_create.formats || !dev_create.num_formats)
-			return -EINVAL;
+	if (copy_from_user(&dev_create, arg, sizeof(dev_create)))
+		return -EFAULT;
+
+	if (!dev_create.formats || !dev_create.num_formats)
+		return -EINVAL;
 
-		formats = memdup_user((void __user *)
-				      (uintptr_t) dev_create.formats,
-				      dev_create.num_formats * sizeof(*formats));
-		if (IS_ERR(formats))
-			return PTR_ERR(formats);
+	formats = memdup_user((void __user *)
+			      (uintptr_t) dev_create.formats,
+			      dev_create.num_formats * sizeof(*formats));
+	if (IS_ERR(formats))
+		return PTR_ERR(formats);
 
-		udev->initialized = true;
-		ret = udrm_drm_register(udev, &dev_create, formats,
-					dev_create.num_formats);
+	if (!dev_create.queue_depth)
+		dev_create.queue_depth = UDRM_DEFAULT_QUEUE_DEPTH;
+	udev->ev_depth = min_t(u32, dev_create.queue_depth,
+			       UDRM_MAX_QUEUE_DEPTH);
+	dev_create.queue_depth = udev->ev_depth;
+
+	ret = udrm_event_pool_alloc(udev);
+	if (ret) {
 		kfree(formats);
+		return ret;
+	}
+
+	if (dev_create.flags & UDRM_DEV_FLAG_RING) {
+		ret = udrm_ring_alloc(udev);
 		if (ret) {
-			udev->initialized = false;
+			udrm_event_pool_free(udev);
+			kfree(formats);
 			return ret;
 		}
+		dev_create.ring_size = udev->ring_size;
+	}
+
+	udev->initialized = true;
+	ret = udrm_drm_register(udev, &dev_create, formats,
+				dev_create.num_formats);
+	kfree(formats);
+	if (ret) {
+		udev->initialized = false;
+		udrm_ring_free(udev);
+		udrm_event_pool_free(udev);
+		return ret;
+	}
 
-		if (copy_to_user((void __user *)arg, &dev_create,
-				 sizeof(dev_create)))
+	list_add_tail(&udev->node, &udrm_devices);
+
+	if (copy_to_user(arg, &dev_create, sizeof(dev_create)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Look up a detached device by name, or by DRM minor if there's no name */
+static struct udrm_device *udrm_dev_find(struct udrm_dev_attach *dev_attach)
+{
+	struct udrm_device *udev, *busy = NULL;
+
+	list_for_each_entry(udev, &udrm_devices, node) {
+		if (dev_attach->name[0] ?
+		    strcmp(udev->driver.name, dev_attach->name) :
+		    udev->drm.primary->index != dev_attach->index)
+			continue;
+		if (udev->detached)
+			return udev;
+		busy = udev;
+	}
+
+	return ERR_PTR(busy ? -EBUSY : -ENODEV);
+}
+
+/*
+ * Hand a detached device over to this file. The udev that open() allocated
+ * for the file can still be in use by a concurrent read() or poll(), so it's
+ * kept as the stub until the file is closed.
+ */
+static int udrm_dev_attach(struct file *file, void __user *arg)
+{
+	struct udrm_device *stub = file->private_data;
+	struct udrm_dev_attach dev_attach;
+	struct udrm_device *udev;
+	unsigned int i;
+	int ret;
+
+	if (stub->initialized || stub->drm_initialized)
+		return -EBUSY;
+
+	if (copy_from_user(&dev_attach, arg, sizeof(dev_attach)))
+		return -EFAULT;
+
+	if (dev_attach.flags & ~(UDRM_DEV_FLAG_RING | UDRM_DEV_FLAG_PERSIST))
+		return -EINVAL;
+
+	dev_attach.name[UDRM_MAX_NAME_SIZE - 1] = '\0';
+	udev = udrm_dev_find(&dev_attach);
+	if (IS_ERR(udev))
+		return PTR_ERR(udev);
+
+	/* The fds are installed by read() in zero-copy mode */
+	if ((dev_attach.flags & UDRM_DEV_FLAG_RING) &&
+	    (udev->buf_mode & UDRM_BUF_MODE_MASK) == UDRM_BUF_MODE_ZERO_COPY)
+		return -EINVAL;
+
+	for (i = 0; i < UDRM_MAX_BUFS; i++)
+		dev_attach.buf_fds[i] = -1;
+
+	for (i = 0; i < udev->num_bufs; i++) {
+		ret = get_unused_fd_flags(O_CLOEXEC);
+		if (ret < 0)
+			goto err_put_fds;
+		dev_attach.buf_fds[i] = ret;
+	}
+
+	dev_attach.ring_size = 0;
+	if (dev_attach.flags & UDRM_DEV_FLAG_RING) {
+		ret = udrm_ring_alloc(udev);
+		if (ret)
+			goto err_put_fds;
+		dev_attach.ring_size = udev->ring_size;
+	}
+
+	dev_attach.index = udev->drm.primary->index;
+	dev_attach.buf_mode = udev->buf_mode;
+	dev_attach.queue_depth = udev->ev_depth;
+	dev_attach.max_clips = udev->max_clips;
+	dev_attach.num_bufs = udev->num_bufs;
+
+	if (copy_to_user(arg, &dev_attach, sizeof(dev_attach))) {
+		ret = -EFAULT;
+		goto err_free_ring;
+	}
+
+	for (i = 0; i < udev->num_bufs; i++) {
+		get_dma_buf(udev->bufs[i].dmabuf);
+		fd_install(dev_attach.buf_fds[i], udev->bufs[i].dmabuf->file);
+	}
+
+	udev->flags &= ~(UDRM_DEV_FLAG_RING | UDRM_DEV_FLAG_PERSIST);
+	udev->flags |= dev_attach.flags;
+	udev->stub = stub;
+	udev->detached = false;
+	spin_lock(&udev->ev_lock);
+	udev->initialized = true;
+	spin_unlock(&udev->ev_lock);
+	file->private_data = udev;
+
+	udrm_queue_work(udev, &udev->attach_work);
+
+	return 0;
+
+err_free_ring:
+	udrm_ring_free(udev);
+err_put_fds:
+	for (i = 0; i < udev->num_bufs; i++)
+		if (dev_attach.buf_fds[i] >= 0)
+			put_unused_fd(dev_attach.buf_fds[i]);
+
+	return ret;
+}
+
+static long udrm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct udrm_device *udev = file->private_data;
+	u32 index;
+	int ret;
+
+	switch (cmd) {
+	case UDRM_DEV_CREATE:
+		mutex_lock(&udrm_devices_lock);
+		/* Lost a race with UDRM_DEV_ATTACH */
+		if (file->private_data != udev)
+			ret = -EBUSY;
+		else
+			ret = udrm_dev_create(udev, (void __user *)arg);
+		mutex_unlock(&udrm_devices_lock);
+		break;
+	case UDRM_DEV_ATTACH:
+		mutex_lock(&udrm_devices_lock);
+		if (file->private_data != udev)
+			ret = -EBUSY;
+		else
+			ret = udrm_dev_attach(file, (void __user *)arg);
+		mutex_unlock(&udrm_devices_lock);
+		break;
+	case UDRM_RING_COMPLETE:
+		if (!udev->ring)
+			return -EINVAL;
+
+		spin_lock(&udev->ev_lock);
+		if (udev->initialized)
+			udrm_ring_reap(udev);
+		spin_unlock(&udev->ev_lock);
+		ret = 0;
+		break;
+	case UDRM_BUF_RELEASE:
+		if (!udev->initialized)
+			return -ENODEV;
+
+		if (get_user(index, (u32 __user *)arg))
 			return -EFAULT;
+
+		ret = udrm_buf_release(udev, index);
 		break;
 	default:
 		ret = -ENOTTY;
@@ -254,6 +884,7 @@ static const struct file_operations udrm_fops = {
 	.read		= udrm_read,
 	.write		= udrm_write,
 	.poll		= udrm_poll,
+	.mmap		= udrm_mmap,
 
 	.unlocked_ioctl	= udrm_ioctl,
 /* FIXME
@@ -269,7 +900,28 @@ static struct miscdevice udrm_misc = {
 	.minor		= MISC_DYNAMIC_MINOR,
 	.name		= "udrm",
 };
-module_misc_device(udrm_misc);
+
+static int __init udrm_init(void)
+{
+	udrm_conv_init();
+
+	return misc_register(&udrm_misc);
+}
+module_init(udrm_init);
+
+static void __exit udrm_exit(void)
+{
+	struct udrm_device *udev, *tmp;
+
+	misc_deregister(&udrm_misc);
+
+	/* /dev/udrm isn't open, so only detached devices are left */
+	list_for_each_entry_safe(udev, tmp, &udrm_devices, node) {
+		list_del(&udev->node);
+		udrm_drm_unregister(udev);
+	}
+}
+module_exit(udrm_exit);
 
 MODULE_AUTHOR("Noralf Trønnes");
 MODULE_DESCRIPTION("Userspace driver support for DRM");
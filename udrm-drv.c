@@ -8,14 +8,38 @@
  */
 
 #include <drm/drm_atomic_helper.h>
+#include <drm/drm_crtc_helper.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_fb_cma_helper.h>
 #include <drm/drm_fb_helper.h>
 #include <linux/dma-buf.h>
+#include <linux/vmalloc.h>
 
 #include <uapi/drm/udrm.h>
 
 #include "udrm.h"
+#include "udrm-trace.h"
+
+#define UDRM_BUF_TIMEOUT	(5 * HZ)
+#define UDRM_VMAP_IDLE		(10 * HZ)
+#define UDRM_VMAP_MAX_FRAMES	4
+
+/* Unknown flags are rejected, so newer userspace can tell they're missing */
+#define UDRM_DEV_FLAGS		(UDRM_DEV_FLAG_RING | \
+				 UDRM_DEV_FLAG_ASYNC_DIRTY | \
+				 UDRM_DEV_FLAG_COPY_FILL | \
+				 UDRM_DEV_FLAG_TILE_HASH | \
+				 UDRM_DEV_FLAG_HIGHPRI | \
+				 UDRM_DEV_FLAG_CPU | \
+				 UDRM_DEV_FLAG_PERSIST)
+
+static void udrm_drm_put(struct udrm_device *udev);
+
+/* Unregistered and waiting for the last DRM file to be closed */
+static bool udrm_gone(struct udrm_device *udev)
+{
+	return !udev->initialized && !udev->detached;
+}
 
 static void udrm_lastclose(struct drm_device *drm)
 {
@@ -24,50 +48,143 @@ static void udrm_lastclose(struct drm_device *drm)
 	DRM_DEBUG_KMS("initialized=%u, fbdev_used=%u\n", udev->initialized,
 		      udev->fbdev_used);
 
-	if (udev->fbdev_used)
+	/* drm_release() calls this after the last postclose */
+	if (udev->torn_down)
+		return;
+
+	if (udev->fbdev_used && !udrm_gone(udev))
 		drm_fbdev_cma_restore_mode(udev->fbdev_cma);
 	else
 		drm_crtc_force_disable_all(drm);
 }
 
-static void udrm_gem_cma_free_object(struct drm_gem_object *gem_obj)
+static inline struct udrm_gem_object *
+to_udrm_gem_obj(struct drm_gem_cma_object *cma_obj)
 {
-	if (gem_obj->import_attach) {
-		struct drm_gem_cma_object *cma_obj;
+	return container_of(cma_obj, struct udrm_gem_object, base);
+}
 
-		cma_obj = to_drm_gem_cma_obj(gem_obj);
-		dma_buf_vunmap(gem_obj->import_attach->dmabuf, cma_obj->vaddr);
-		cma_obj->vaddr = NULL;
-	}
+static struct drm_gem_object *
+udrm_gem_create_object(struct drm_device *drm, size_t size)
+{
+	struct udrm_gem_object *obj;
 
-	drm_gem_cma_free_object(gem_obj);
+	obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+	if (!obj)
+		return NULL;
+
+	INIT_LIST_HEAD(&obj->vmap_node);
+
+	return &obj->base.base;
 }
 
-static struct drm_gem_object *
-udrm_gem_cma_prime_import_sg_table(struct drm_device *drm,
-				      struct dma_buf_attachment *attach,
-				      struct sg_table *sgt)
-{
-	struct drm_gem_cma_object *cma_obj;
-	struct drm_gem_object *obj;
-	void *vaddr;
-
-	vaddr = dma_buf_vmap(attach->dmabuf);
-	if (!vaddr) {
-		DRM_ERROR("Failed to vmap PRIME buffer\n");
-		return ERR_PTR(-ENOMEM);
+/* Must be called with vmap_lock held */
+static void udrm_gem_vunmap_locked(struct udrm_device *udev,
+				   struct udrm_gem_object *obj)
+{
+	struct drm_gem_object *gem_obj = &obj->base.base;
+
+	dma_buf_vunmap(gem_obj->import_attach->dmabuf, obj->base.vaddr);
+	obj->base.vaddr = NULL;
+	list_del_init(&obj->vmap_node);
+	udev->vmap_size -= gem_obj->size;
+}
+
+/*
+ * Must be called with vmap_lock held. Unmaps the idle buffers and then the
+ * least recently used ones until @size more bytes fit.
+ */
+static void udrm_gem_vmap_evict(struct udrm_device *udev, size_t size)
+{
+	struct udrm_gem_object *obj, *tmp;
+
+	list_for_each_entry_safe(obj, tmp, &udev->vmap_lru, vmap_node) {
+		if (obj->vmap_pin)
+			continue;
+		if (udev->vmap_size + size <= udev->vmap_max &&
+		    time_before(jiffies, obj->vmap_used + UDRM_VMAP_IDLE))
+			break;
+		udrm_gem_vunmap_locked(udev, obj);
 	}
+}
+
+static void udrm_gem_vmap_work(struct work_struct *work)
+{
+	struct udrm_device *udev = container_of(to_delayed_work(work),
+						struct udrm_device, vmap_work);
+	bool empty;
 
-	obj = drm_gem_cma_prime_import_sg_table(drm, attach, sgt);
-	if (IS_ERR(obj)) {
-		dma_buf_vunmap(attach->dmabuf, vaddr);
-		return obj;
+	mutex_lock(&udev->vmap_lock);
+	udrm_gem_vmap_evict(udev, 0);
+	empty = list_empty(&udev->vmap_lru);
+	mutex_unlock(&udev->vmap_lock);
+
+	if (!empty)
+		schedule_delayed_work(&udev->vmap_work, UDRM_VMAP_IDLE);
+}
+
+/*
+ * Make sure an imported buffer is vmapped and keep it that way until
+ * udrm_gem_vmap_put(). The cap on mapped bytes is soft, a flush always
+ * gets its mapping.
+ */
+int udrm_gem_vmap_get(struct udrm_device *udev,
+		      struct drm_gem_cma_object *cma_obj)
+{
+	struct udrm_gem_object *obj = to_udrm_gem_obj(cma_obj);
+	struct drm_gem_object *gem_obj = &cma_obj->base;
+
+	if (!gem_obj->import_attach)
+		return 0;
+
+	mutex_lock(&udev->vmap_lock);
+	if (!cma_obj->vaddr) {
+		udrm_gem_vmap_evict(udev, gem_obj->size);
+		cma_obj->vaddr = dma_buf_vmap(gem_obj->import_attach->dmabuf);
+		if (!cma_obj->vaddr) {
+			mutex_unlock(&udev->vmap_lock);
+			DRM_ERROR("Failed to vmap PRIME buffer\n");
+			return -ENOMEM;
+		}
+		udev->vmap_size += gem_obj->size;
 	}
+	obj->vmap_pin++;
+	obj->vmap_used = jiffies;
+	list_move_tail(&obj->vmap_node, &udev->vmap_lru);
+	mutex_unlock(&udev->vmap_lock);
+
+	schedule_delayed_work(&udev->vmap_work, UDRM_VMAP_IDLE);
 
-	cma_obj = to_drm_gem_cma_obj(obj);
-	cma_obj->vaddr = vaddr;
+	return 0;
+}
 
-	return obj;
+void udrm_gem_vmap_put(struct udrm_device *udev,
+		       struct drm_gem_cma_object *cma_obj)
+{
+	struct udrm_gem_object *obj = to_udrm_gem_obj(cma_obj);
+
+	if (!cma_obj->base.import_attach)
+		return;
+
+	mutex_lock(&udev->vmap_lock);
+	obj->vmap_pin--;
+	obj->vmap_used = jiffies;
+	mutex_unlock(&udev->vmap_lock);
+}
+
+static void udrm_gem_cma_free_object(struct drm_gem_object *gem_obj)
+{
+	struct udrm_device *udev = drm_to_udrm(gem_obj->dev);
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(gem_obj);
+
+	if (gem_obj->import_attach) {
+		mutex_lock(&udev->vmap_lock);
+		if (cma_obj->vaddr)
+			udrm_gem_vunmap_locked(udev, to_udrm_gem_obj(cma_obj));
+		mutex_unlock(&udev->vmap_lock);
+	}
+
+	drm_gem_cma_free_object(gem_obj);
 }
 
 static int udrm_prime_handle_to_fd_ioctl(struct drm_device *dev, void *data,
@@ -103,28 +220,236 @@ static const struct file_operations udrm_drm_fops = {
 	.mmap		= drm_gem_cma_mmap,
 };
 
+/* Each open DRM file keeps the device from being torn down */
+static int udrm_drm_open(struct drm_device *drm, struct drm_file *file_priv)
+{
+	struct udrm_device *udev = drm_to_udrm(drm);
+
+	if (!atomic_inc_not_zero(&udev->users))
+		return -ENODEV;
+
+	return 0;
+}
+
+static void udrm_drm_postclose(struct drm_device *drm,
+			       struct drm_file *file_priv)
+{
+	udrm_drm_put(drm_to_udrm(drm));
+}
+
+/*
+ * Userspace has told us when the frame reached the display, so don't wait
+ * for vblank, use that time in the event right away.
+ */
+static void udrm_crtc_send_present_event(struct drm_crtc *crtc,
+					 struct drm_pending_vblank_event *e,
+					 ktime_t timestamp)
+{
+	struct udrm_device *udev = drm_to_udrm(crtc->dev);
+	struct timeval tv = ktime_to_timeval(timestamp);
+
+	spin_lock_irq(&crtc->dev->event_lock);
+	e->event.sequence = drm_crtc_vblank_count(crtc);
+	e->event.tv_sec = tv.tv_sec;
+	e->event.tv_usec = tv.tv_usec;
+	drm_send_event_locked(crtc->dev, &e->base);
+	spin_unlock_irq(&crtc->dev->event_lock);
+
+	trace_udrm_vblank_event(udev, udrm_trace_scanout_fb_id(udev), false);
+}
+
 static void udrm_dirty_work(struct work_struct *work)
 {
 	struct udrm_device *udev = container_of(work, struct udrm_device,
 						   dirty_work);
 	struct drm_framebuffer *fb = udev->pipe.plane.fb;
 	struct drm_crtc *crtc = &udev->pipe.crtc;
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS];
+	unsigned int num_clips;
+	ktime_t timestamp = 0;
+
+	trace_udrm_dirty_work_begin(udev, fb ? fb->base.id : 0);
+
+	spin_lock(&udev->damage_lock);
+	num_clips = udev->num_flip_damage;
+	memcpy(clips, udev->flip_damage, num_clips * sizeof(*clips));
+	udev->flip_pending = false;
+	spin_unlock(&udev->damage_lock);
 
+	/* No damage clips means a full flush */
 	if (fb)
-		fb->funcs->dirty(fb, NULL, 0, 0, NULL, 0);
+		udrm_fb_flush(fb, 0, 0, num_clips ? clips : NULL, num_clips,
+			      &timestamp);
 
 	if (udev->event) {
 		DRM_DEBUG_KMS("crtc event\n");
-		spin_lock_irq(&crtc->dev->event_lock);
-		drm_crtc_send_vblank_event(crtc, udev->event);
-		spin_unlock_irq(&crtc->dev->event_lock);
+		if (timestamp)
+			udrm_crtc_send_present_event(crtc, udev->event,
+						     timestamp);
+		else
+			udrm_crtc_send_vblank_event(crtc, udev->event);
 		udev->event = NULL;
 	}
+
+	trace_udrm_dirty_work_end(udev, fb ? fb->base.id : 0);
+}
+
+/*
+ * Bring a userspace driver that has just attached up to date. This runs on
+ * the device workqueue, so flushes queued after it reach the new driver
+ * after the replay.
+ */
+static void udrm_attach_work(struct work_struct *work)
+{
+	struct udrm_device *udev = container_of(work, struct udrm_device,
+						attach_work);
+	struct drm_framebuffer *fb = udev->pipe.plane.fb;
+	struct udrm_event ev = {
+		.type = UDRM_EVENT_PIPE_ENABLE,
+		.length = sizeof(ev),
+	};
+
+	udrm_fb_replay(udev);
+
+	if (!udev->prepared)
+		return;
+
+	udrm_send_event(udev, &ev);
+
+	/* Full flush, the new driver knows nothing about the display */
+	if (fb) {
+		udev->enabled = false;
+		udrm_fb_flush(fb, 0, 0, NULL, 0, NULL);
+	}
+}
+
+/*
+ * Trace the armed event once drm_crtc_handle_vblank() has taken it off the
+ * vblank event list. The pointer is only compared, the event can be freed.
+ */
+static void udrm_vblank_trace_delivered(struct udrm_device *udev)
+{
+	struct drm_device *drm = &udev->drm;
+	struct drm_pending_vblank_event *e;
+	bool delivered = false;
+	unsigned long flags;
+	u32 fb_id;
+
+	if (!READ_ONCE(udev->armed_event))
+		return;
+
+	spin_lock_irqsave(&drm->event_lock, flags);
+	if (udev->armed_event) {
+		delivered = true;
+		list_for_each_entry(e, &drm->vblank_event_list, base.link) {
+			if (e == udev->armed_event) {
+				delivered = false;
+				break;
+			}
+		}
+	}
+	if (delivered) {
+		fb_id = udev->armed_fb_id;
+		udev->armed_event = NULL;
+	}
+	spin_unlock_irqrestore(&drm->event_lock, flags);
+
+	if (delivered)
+		trace_udrm_vblank_event(udev, fb_id, true);
+}
+
+/*
+ * There's no scanout to signal vblank, so emulate it with a timer running at
+ * the refresh rate of the display mode while vblank is enabled.
+ */
+static enum hrtimer_restart udrm_vblank_timer(struct hrtimer *timer)
+{
+	struct udrm_device *udev = container_of(timer, struct udrm_device,
+						vblank_timer);
+
+	if (!READ_ONCE(udev->vblank_enabled))
+		return HRTIMER_NORESTART;
+
+	drm_crtc_handle_vblank(&udev->pipe.crtc);
+	udrm_vblank_trace_delivered(udev);
+	hrtimer_forward_now(timer, udev->vblank_period);
+
+	return HRTIMER_RESTART;
+}
+
+static int udrm_enable_vblank(struct drm_device *drm, unsigned int pipe)
+{
+	struct udrm_device *udev = drm_to_udrm(drm);
+
+	WRITE_ONCE(udev->vblank_enabled, true);
+	hrtimer_start(&udev->vblank_timer, udev->vblank_period,
+		      HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+/*
+ * This is called with the vblank time lock held which the timer callback
+ * also takes, so the timer can't be waited on here. The callback stops
+ * rearming itself when it sees vblank disabled.
+ */
+static void udrm_disable_vblank(struct drm_device *drm, unsigned int pipe)
+{
+	struct udrm_device *udev = drm_to_udrm(drm);
+
+	WRITE_ONCE(udev->vblank_enabled, false);
+	hrtimer_try_to_cancel(&udev->vblank_timer);
+}
+
+/*
+ * Deliver the event on the next emulated vblank, or right away if vblank is
+ * off (pipe disabled).
+ */
+void udrm_crtc_send_vblank_event(struct drm_crtc *crtc,
+				 struct drm_pending_vblank_event *event)
+{
+	struct udrm_device *udev = drm_to_udrm(crtc->dev);
+	bool armed;
+
+	spin_lock_irq(&crtc->dev->event_lock);
+	armed = !drm_crtc_vblank_get(crtc);
+	if (armed) {
+		drm_crtc_arm_vblank_event(crtc, event);
+		/* Traced by the vblank timer when it's delivered */
+		if (trace_udrm_vblank_event_enabled()) {
+			udev->armed_event = event;
+			udev->armed_fb_id = udrm_trace_scanout_fb_id(udev);
+		}
+	} else {
+		drm_crtc_send_vblank_event(crtc, event);
+	}
+	spin_unlock_irq(&crtc->dev->event_lock);
+
+	if (!armed)
+		trace_udrm_vblank_event(udev, udrm_trace_scanout_fb_id(udev),
+					false);
+}
+
+/* DRM files left open after the driver has gone can only turn it off */
+static int udrm_atomic_check(struct drm_device *drm,
+			     struct drm_atomic_state *state)
+{
+	struct drm_crtc_state *crtc_state;
+	struct drm_crtc *crtc;
+	int i;
+
+	if (udrm_gone(drm_to_udrm(drm))) {
+		for_each_crtc_in_state(state, crtc, crtc_state, i)
+			if (crtc_state->active)
+				return -ENODEV;
+	}
+
+	return drm_atomic_helper_check(drm, state);
 }
 
 static const struct drm_mode_config_funcs udrm_mode_config_funcs = {
 	.fb_create = udrm_fb_create,
-	.atomic_check = drm_atomic_helper_check,
+	.atomic_check = udrm_atomic_check,
 	.atomic_commit = drm_atomic_helper_commit,
 };
 
@@ -140,6 +465,7 @@ static int udrm_drm_init(struct udrm_device *udev, char *drv_name)
 
 	drv->driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_PRIME |
 				  DRIVER_ATOMIC;
+	drv->gem_create_object		= udrm_gem_create_object;
 	drv->gem_free_object		= udrm_gem_cma_free_object;
 	drv->gem_vm_ops			= &drm_gem_cma_vm_ops;
 	drv->prime_handle_to_fd		= drm_gem_prime_handle_to_fd;
@@ -147,7 +473,7 @@ static int udrm_drm_init(struct udrm_device *udev, char *drv_name)
 	drv->gem_prime_import		= drm_gem_prime_import;
 	drv->gem_prime_export		= drm_gem_prime_export;
 	drv->gem_prime_get_sg_table	= drm_gem_cma_prime_get_sg_table;
-	drv->gem_prime_import_sg_table	= udrm_gem_cma_prime_import_sg_table;
+	drv->gem_prime_import_sg_table	= drm_gem_cma_prime_import_sg_table;
 	drv->gem_prime_vmap		= drm_gem_cma_prime_vmap;
 	drv->gem_prime_vunmap		= drm_gem_cma_prime_vunmap;
 	drv->gem_prime_mmap		= drm_gem_cma_prime_mmap;
@@ -156,6 +482,13 @@ static int udrm_drm_init(struct udrm_device *udev, char *drv_name)
 	drv->dumb_destroy		= drm_gem_dumb_destroy;
 	drv->fops			= &udrm_drm_fops;
 	drv->lastclose			= udrm_lastclose;
+	drv->open			= udrm_drm_open;
+	drv->postclose			= udrm_drm_postclose;
+	drv->get_vblank_counter		= drm_vblank_no_hw_counter;
+	drv->enable_vblank		= udrm_enable_vblank;
+	drv->disable_vblank		= udrm_disable_vblank;
+	drv->debugfs_init		= udrm_debugfs_init;
+	drv->debugfs_cleanup		= udrm_debugfs_cleanup;
 
 	drv->ioctls		= udrm_ioctls;
 	drv->num_ioctls		= ARRAY_SIZE(udrm_ioctls);
@@ -166,11 +499,30 @@ static int udrm_drm_init(struct udrm_device *udev, char *drv_name)
 	drv->minor		= 0;
 
 	INIT_WORK(&udev->dirty_work, udrm_dirty_work);
-	mutex_init(&udev->dev_lock);
+	INIT_WORK(&udev->flush_work, udrm_fb_flush_work);
+	INIT_WORK(&udev->fbdev_op_work, udrm_fbdev_op_work);
+	INIT_WORK(&udev->attach_work, udrm_attach_work);
+	spin_lock_init(&udev->damage_lock);
+	spin_lock_init(&udev->fbdev_op_slock);
+	mutex_init(&udev->fbdev_op_lock);
+	spin_lock_init(&udev->buf_lock);
+	init_waitqueue_head(&udev->buf_waitq);
+	mutex_init(&udev->vmap_lock);
+	INIT_LIST_HEAD(&udev->vmap_lru);
+	INIT_DELAYED_WORK(&udev->vmap_work, udrm_gem_vmap_work);
+	hrtimer_init(&udev->vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	udev->vblank_timer.function = udrm_vblank_timer;
+
+	ret = udrm_stats_init(udev);
+	if (ret)
+		return ret;
 
 	ret = drm_dev_init(drm, drv, NULL);
-	if (ret)
+	if (ret) {
+		udrm_stats_fini(udev);
 		return ret;
+	}
+	udev->drm_initialized = true;
 
 	drm_mode_config_init(drm);
 	drm->mode_config.funcs = &udrm_mode_config_funcs;
@@ -184,52 +536,301 @@ static void udrm_drm_fini(struct udrm_device *udev)
 
 	DRM_DEBUG_KMS("udrm_drm_fini\n");
 
-	mutex_destroy(&udev->dev_lock);
+	mutex_destroy(&udev->fbdev_op_lock);
+	/* The timer callback uses the vblank state, stop it first */
+	hrtimer_cancel(&udev->vblank_timer);
+	drm_vblank_cleanup(drm);
 	drm_mode_config_cleanup(drm);
-	drm_dev_unref(drm);
+	udrm_stats_fini(udev);
+}
+
+static void udrm_buf_put(struct udrm_device *udev)
+{
+	unsigned int i;
+
+	for (i = 0; i < udev->num_bufs; i++) {
+		if (udev->bufs[i].vaddr)
+			dma_buf_vunmap(udev->bufs[i].dmabuf,
+				       udev->bufs[i].vaddr);
+		dma_buf_put(udev->bufs[i].dmabuf);
+		kfree(udev->bufs[i].line);
+		kfree(udev->bufs[i].err);
+		vfree(udev->bufs[i].scratch);
+	}
+	udev->num_bufs = 0;
 }
 
-static int udrm_buf_get(struct udrm_device *udev, int fd, u32 mode,
-			   uint32_t *formats, unsigned int num_formats)
+/*
+ * Runs once, when the userspace driver and all DRM files are gone. The file
+ * objects are released by then, so nothing else holds a framebuffer.
+ */
+static void udrm_drm_teardown(struct udrm_device *udev)
 {
+	struct drm_device *drm = &udev->drm;
+
+	DRM_DEBUG_KMS("udrm_drm_teardown\n");
+
+	drm_crtc_force_disable_all(drm);
+	cancel_work_sync(&udev->dirty_work);
+	udrm_fb_flush_cancel(udev);
+	udrm_fbdev_fini(udev);
+	cancel_delayed_work_sync(&udev->vmap_work);
+
+	destroy_workqueue(udev->wq);
+	udrm_fb_conv_fini(udev);
+	udrm_buf_put(udev);
+	udrm_fb_tile_hash_fini(udev);
+	udrm_drm_fini(udev);
+
+	/* The framebuffers are gone, so no more events */
+	kfree(udev->ev_pool_mem);
+	udev->ev_pool_mem = NULL;
+	idr_destroy(&udev->idr);
+	udev->torn_down = true;
+}
+
+/* udev is freed with the last drm_device reference after this */
+static void udrm_drm_put(struct udrm_device *udev)
+{
+	if (!atomic_dec_and_test(&udev->users))
+		return;
+
+	udrm_drm_teardown(udev);
+	drm_dev_unref(&udev->drm);
+}
+
+static int udrm_buf_get(struct udrm_device *udev, int *fds,
+			unsigned int num_fds, u32 mode,
+			uint32_t *formats, unsigned int num_formats)
+{
+	unsigned int width = udev->display_mode.hdisplay;
+	unsigned int gray_bpp = udrm_buf_gray_bpp(mode);
+	struct udrm_buf *buf;
+	struct dma_buf *dmabuf;
 	int i, max_cpp = 0;
 	size_t len;
 
-	if (mode & UDRM_BUF_MODE_EMUL_XRGB8888) {
+	switch (mode & UDRM_BUF_MODE_MASK) {
+	case UDRM_BUF_MODE_PLAIN_COPY:
+	case UDRM_BUF_MODE_SWAP_BYTES:
+	case UDRM_BUF_MODE_GRAY8:
+	case UDRM_BUF_MODE_GRAY4:
+	case UDRM_BUF_MODE_GRAY2:
+	case UDRM_BUF_MODE_MONO:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if ((mode & UDRM_BUF_MODE_RLE) && (mode & UDRM_BUF_MODE_ROW_DELTA))
+		return -EINVAL;
+
+	if (gray_bpp) {
+		for (i = 0; i < num_formats; i++)
+			if (!udrm_conv_supported(formats[i],
+						 DRM_FORMAT_XRGB8888))
+				return -EINVAL;
+	} else if (mode & UDRM_BUF_MODE_EMULATE) {
+		for (i = 1; i < num_formats; i++)
+			if (!udrm_conv_supported(formats[i], formats[0]))
+				return -EINVAL;
+		udev->buf_format = formats[0];
+	} else if (mode & UDRM_BUF_MODE_EMUL_XRGB8888) {
 		if (formats[0] != DRM_FORMAT_RGB565)
 			return -EINVAL;
-		udev->emulate_xrgb8888_format = formats[0];
+		udev->buf_format = formats[0];
 	}
 
 	for (i = 0; i < num_formats; i++) {
-		if (udev->emulate_xrgb8888_format &&
-		    formats[i] == DRM_FORMAT_XRGB8888)
-			continue;
-		max_cpp = max(max_cpp, drm_format_plane_cpp(formats[i], 0));
+		if ((mode & UDRM_BUF_MODE_EMULATE) ||
+		    ((mode & UDRM_BUF_MODE_EMUL_XRGB8888) &&
+		     formats[i] == DRM_FORMAT_XRGB8888))
+			max_cpp = max(max_cpp,
+				      drm_format_plane_cpp(udev->buf_format, 0));
+		else
+			max_cpp = max(max_cpp,
+				      drm_format_plane_cpp(formats[i], 0));
 	}
 
 	if (!max_cpp)
 		return -EINVAL;
 
-	len = udev->display_mode.hdisplay * udev->display_mode.vdisplay * max_cpp;
+	if (gray_bpp)
+		len = DIV_ROUND_UP(width * gray_bpp, 8) *
+		      udev->display_mode.vdisplay;
+	else
+		len = width * udev->display_mode.vdisplay * max_cpp;
+	udev->buf_size = SIZE_MAX;
+
+	for (i = 0; i < num_fds; i++) {
+		dmabuf = dma_buf_get(fds[i]);
+		if (IS_ERR(dmabuf)) {
+			udrm_buf_put(udev);
+			return PTR_ERR(dmabuf);
+		}
+
+		buf = &udev->bufs[i];
+		memset(buf, 0, sizeof(*buf));
+		buf->dmabuf = dmabuf;
+		udev->num_bufs++;
+
+		/* Conversion scratch space, per buffer since flushes overlap */
+		if (gray_bpp) {
+			buf->line = kmalloc_array(width, sizeof(*buf->line),
+						  GFP_KERNEL);
+			if (mode & UDRM_BUF_MODE_DITHER_DIFFUSION)
+				buf->err = kmalloc_array(2 * (width + 2),
+							 sizeof(*buf->err),
+							 GFP_KERNEL);
+			if (!buf->line ||
+			    ((mode & UDRM_BUF_MODE_DITHER_DIFFUSION) &&
+			     !buf->err)) {
+				udrm_buf_put(udev);
+				return -ENOMEM;
+			}
+		}
+
+		/* Encoded flushes are converted here first */
+		if (mode & (UDRM_BUF_MODE_RLE | UDRM_BUF_MODE_ROW_DELTA)) {
+			buf->scratch = vmalloc(len);
+			if (!buf->scratch) {
+				udrm_buf_put(udev);
+				return -ENOMEM;
+			}
+		}
+
+		if (len > dmabuf->size) {
+			udrm_buf_put(udev);
+			return -EINVAL;
+		}
 
-	udev->dmabuf = dma_buf_get(fd);
-	if (IS_ERR(udev->dmabuf))
-		return PTR_ERR(udev->dmabuf);
+		udev->buf_size = min(udev->buf_size, dmabuf->size);
 
-	if (len > udev->dmabuf->size) {
-		dma_buf_put(udev->dmabuf);
-		return -EINVAL;
+		/* Mapped for the lifetime of the device, not per flush */
+		buf->vaddr = dma_buf_vmap(dmabuf);
+		if (!buf->vaddr) {
+			udrm_buf_put(udev);
+			return -ENOMEM;
+		}
 	}
 
+	/* A frame always fits the scratch buffer, merged clips don't */
+	if (mode & (UDRM_BUF_MODE_RLE | UDRM_BUF_MODE_ROW_DELTA))
+		udev->buf_size = min(udev->buf_size, len);
+
 	/* FIXME is dma_buf_attach() necessary when there's no device? */
 
 	udev->buf_mode = mode;
-	udev->buf_fd = fd;
 
 	return 0;
 }
 
+static struct udrm_buf *udrm_buf_try_acquire(struct udrm_device *udev)
+{
+	struct udrm_buf *buf = NULL;
+	unsigned int i;
+
+	/* Take the least recently used buffer */
+	spin_lock(&udev->buf_lock);
+	for (i = 0; i < udev->num_bufs; i++) {
+		if (udev->bufs[i].busy)
+			continue;
+		if (!buf || udev->bufs[i].last_flush < buf->last_flush)
+			buf = &udev->bufs[i];
+	}
+
+	if (buf) {
+		udev->buf_flushes++;
+		buf->age = buf->last_flush ?
+			   udev->buf_flushes - buf->last_flush : 0;
+		buf->last_flush = udev->buf_flushes;
+		buf->busy = true;
+	}
+	spin_unlock(&udev->buf_lock);
+
+	return buf;
+}
+
+/* Wait for a transfer buffer that userspace isn't using */
+struct udrm_buf *udrm_buf_acquire(struct udrm_device *udev)
+{
+	struct udrm_buf *buf;
+
+	if (!wait_event_timeout(udev->buf_waitq,
+				(buf = udrm_buf_try_acquire(udev)),
+				UDRM_BUF_TIMEOUT))
+		return ERR_PTR(-ETIMEDOUT);
+
+	return buf;
+}
+
+static void udrm_buf_wake(struct udrm_device *udev)
+{
+	wake_up(&udev->buf_waitq);
+
+	/* Damage might have piled up waiting for a buffer */
+	if (udev->flags & UDRM_DEV_FLAG_ASYNC_DIRTY)
+		udrm_queue_work(udev, &udev->flush_work);
+}
+
+/*
+ * The flush using @buf is done. It stays busy if userspace has retained it,
+ * until UDRM_BUF_RELEASE.
+ */
+void udrm_buf_done(struct udrm_device *udev, struct udrm_buf *buf,
+		   bool retain)
+{
+	spin_lock(&udev->buf_lock);
+	if (retain)
+		buf->retained = true;
+	else
+		buf->busy = false;
+	spin_unlock(&udev->buf_lock);
+
+	if (!retain)
+		udrm_buf_wake(udev);
+}
+
+/* Only buffers retained by userspace can be released */
+int udrm_buf_release(struct udrm_device *udev, unsigned int index)
+{
+	struct udrm_buf *buf;
+	int ret = 0;
+
+	if (index >= udev->num_bufs)
+		return -EINVAL;
+
+	buf = &udev->bufs[index];
+	spin_lock(&udev->buf_lock);
+	if (buf->retained) {
+		buf->retained = false;
+		buf->busy = false;
+	} else {
+		ret = -EINVAL;
+	}
+	spin_unlock(&udev->buf_lock);
+
+	if (ret)
+		return ret;
+
+	udrm_buf_wake(udev);
+
+	return 0;
+}
+
+bool udrm_buf_available(struct udrm_device *udev)
+{
+	bool available = false;
+	unsigned int i;
+
+	spin_lock(&udev->buf_lock);
+	for (i = 0; i < udev->num_bufs; i++)
+		available |= !udev->bufs[i].busy;
+	spin_unlock(&udev->buf_lock);
+
+	return available;
+}
+
 static void fbdev_init_work(struct work_struct *work)
 {
 	struct udrm_device *udev = container_of(work, struct udrm_device,
@@ -242,12 +843,52 @@ static void fbdev_init_work(struct work_struct *work)
 
 }
 
+/*
+ * Ordered, so the flush work of a device never runs concurrently. Pinning
+ * to a CPU uses a bound workqueue with max_active 1 and always queues on
+ * that CPU, which is just as ordered.
+ */
+static int udrm_wq_init(struct udrm_device *udev,
+			struct udrm_dev_create *dev_create)
+{
+	unsigned int flags = 0;
+
+	if (udev->flags & UDRM_DEV_FLAG_HIGHPRI)
+		flags |= WQ_HIGHPRI;
+
+	udev->wq_cpu = -1;
+	if (udev->flags & UDRM_DEV_FLAG_CPU) {
+		if (dev_create->cpu >= nr_cpu_ids ||
+		    !cpu_online(dev_create->cpu))
+			return -EINVAL;
+		udev->wq_cpu = dev_create->cpu;
+		udev->wq = alloc_workqueue("udrm-%s", flags, 1,
+					   dev_create->name);
+	} else {
+		udev->wq = alloc_ordered_workqueue("udrm-%s", flags,
+						   dev_create->name);
+	}
+
+	return udev->wq ? 0 : -ENOMEM;
+}
+
+void udrm_queue_work(struct udrm_device *udev, struct work_struct *work)
+{
+	if (udev->wq_cpu >= 0)
+		queue_work_on(udev->wq_cpu, udev->wq, work);
+	else
+		queue_work(udev->wq, work);
+}
+
 int udrm_drm_register(struct udrm_device *udev,
 		      struct udrm_dev_create *dev_create,
 		      uint32_t *formats, unsigned int num_formats)
 {
 	struct drm_device *drm;
-	int ret;
+	int vrefresh, ret;
+
+	if (dev_create->flags & ~UDRM_DEV_FLAGS)
+		return -EINVAL;
 
 	ret = drm_mode_convert_umode(&udev->display_mode, &dev_create->mode);
 	if (ret)
@@ -255,20 +896,71 @@ int udrm_drm_register(struct udrm_device *udev,
 
 	drm_mode_debug_printmodeline(&udev->display_mode);
 
-	if (dev_create->buf_mode) {
-		ret = udrm_buf_get(udev, dev_create->buf_fd, dev_create->buf_mode,
-				   formats, num_formats);
+	vrefresh = drm_mode_vrefresh(&udev->display_mode);
+	if (!vrefresh)
+		vrefresh = 60;
+	udev->vblank_period = ktime_set(0, NSEC_PER_SEC / vrefresh);
+
+	udev->vmap_max = (size_t)UDRM_VMAP_MAX_FRAMES *
+			 udev->display_mode.hdisplay *
+			 udev->display_mode.vdisplay * 4;
+
+	udev->flags = dev_create->flags;
+	udev->max_clips = clamp_t(u32, dev_create->max_clips, 1,
+				  UDRM_MAX_CLIPS);
+	udev->clip_cost = dev_create->clip_cost;
+	dev_create->max_clips = udev->max_clips;
+
+	if ((dev_create->buf_mode & UDRM_BUF_MODE_MASK) ==
+	    UDRM_BUF_MODE_ZERO_COPY) {
+		if (udev->ring)
+			return -EINVAL;
+		udev->buf_mode = dev_create->buf_mode;
+	} else if (dev_create->buf_mode) {
+		if (dev_create->num_bufs > UDRM_MAX_BUFS)
+			return -EINVAL;
+
+		if (dev_create->num_bufs)
+			ret = udrm_buf_get(udev, dev_create->buf_fds,
+					   dev_create->num_bufs,
+					   dev_create->buf_mode,
+					   formats, num_formats);
+		else
+			ret = udrm_buf_get(udev, &dev_create->buf_fd, 1,
+					   dev_create->buf_mode,
+					   formats, num_formats);
 		if (ret)
 			return ret;
 	}
 
+	if (udev->flags & UDRM_DEV_FLAG_TILE_HASH) {
+		ret = udrm_fb_tile_hash_init(udev);
+		if (ret)
+			goto err_put_bufs;
+	}
+
+	ret = udrm_fb_conv_init(udev);
+	if (ret)
+		goto err_free_tiles;
+
+	ret = udrm_wq_init(udev, dev_create);
+	if (ret)
+		goto err_conv_fini;
+
 	ret = udrm_drm_init(udev, dev_create->name);
 	if (ret)
-		goto err_put_dmabuf;
+		goto err_destroy_wq;
 
 	drm = &udev->drm;
 	drm->mode_config.funcs = &udrm_mode_config_funcs;
 
+	ret = drm_vblank_init(drm, 1);
+	if (ret)
+		goto err_fini;
+
+	/* DRM_IOCTL_WAIT_VBLANK needs this, the timer is our interrupt */
+	drm->irq_enabled = true;
+
 	ret = udrm_display_pipe_init(udev, DRM_MODE_CONNECTOR_VIRTUAL,
 				     formats, num_formats);
 	if (ret)
@@ -280,6 +972,9 @@ int udrm_drm_register(struct udrm_device *udev,
 
 	DRM_DEBUG_KMS("preferred_depth=%u\n", drm->mode_config.preferred_depth);
 
+	/* The userspace driver, see udrm_drm_put() */
+	atomic_set(&udev->users, 1);
+
 	ret = drm_dev_register(drm, 0);
 	if (ret)
 		goto err_fini;
@@ -296,29 +991,92 @@ int udrm_drm_register(struct udrm_device *udev,
 
 	return 0;
 
-err_put_dmabuf:
-	if (udev->dmabuf)
-		dma_buf_put(udev->dmabuf);
 err_fini:
+	destroy_workqueue(udev->wq);
+	udrm_fb_conv_fini(udev);
+	udrm_fb_tile_hash_fini(udev);
+	udrm_buf_put(udev);
 	udrm_drm_fini(udev);
 
 	return ret;
+
+err_destroy_wq:
+	destroy_workqueue(udev->wq);
+err_conv_fini:
+	udrm_fb_conv_fini(udev);
+err_free_tiles:
+	udrm_fb_tile_hash_fini(udev);
+err_put_bufs:
+	udrm_buf_put(udev);
+
+	return ret;
+}
+
+/*
+ * Give back the transfer buffers a departed driver retained, so flushes
+ * waiting in udrm_buf_acquire() go ahead and fail instead of timing out.
+ * The ones in flight are given back when their flush fails.
+ */
+static void udrm_buf_reclaim(struct udrm_device *udev)
+{
+	unsigned int i;
+
+	spin_lock(&udev->buf_lock);
+	for (i = 0; i < udev->num_bufs; i++) {
+		if (udev->bufs[i].retained) {
+			udev->bufs[i].retained = false;
+			udev->bufs[i].busy = false;
+		}
+	}
+	spin_unlock(&udev->buf_lock);
+	wake_up(&udev->buf_waitq);
 }
 
+/*
+ * The userspace driver is gone. Unregister the DRM device so it can't be
+ * opened again. It's torn down right away if no DRM file is open, otherwise
+ * in the postclose of the last one. drm_unplug_dev() isn't used since it
+ * would unregister the device a second time from drm_release().
+ */
 void udrm_drm_unregister(struct udrm_device *udev)
 {
 	struct drm_device *drm = &udev->drm;
 
 	DRM_DEBUG_KMS("udrm_drm_unregister\n");
 
+	/* Not waiting for a driver to attach anymore, see udrm_gone() */
+	udev->detached = false;
+
+	/* Before waiting for flush and dirty work that might need a buffer */
+	udrm_buf_reclaim(udev);
+
+	/* Its events fail now, so this doesn't take long */
 	cancel_work_sync(&udev->fbdev_init_work);
+	cancel_work_sync(&udev->attach_work);
+
+	/* Let compositors that still have it open know the display is gone */
+	mutex_lock(&drm->mode_config.mutex);
+	udev->connector.status = connector_status_disconnected;
+	mutex_unlock(&drm->mode_config.mutex);
+	drm_kms_helper_hotplug_event(drm);
+
+	/* vblank goes away with drm_dev_unregister(), stop the timer first */
 	drm_crtc_force_disable_all(drm);
-	cancel_work_sync(&udev->dirty_work);
-	udrm_fbdev_fini(udev);
+	hrtimer_cancel(&udev->vblank_timer);
+
 	drm_dev_unregister(drm);
+	udrm_drm_put(udev);
+}
 
-	if (udev->dmabuf)
-		dma_buf_put(udev->dmabuf);
+/*
+ * The userspace driver of a persistent device has gone away, its events
+ * already fail. Give back the transfer buffers it held on to and stop
+ * replaying to it.
+ */
+void udrm_drm_detach(struct udrm_device *udev)
+{
+	DRM_DEBUG_KMS("udrm_drm_detach\n");
 
-	udrm_drm_fini(udev);
+	udrm_buf_reclaim(udev);
+	cancel_work_sync(&udev->attach_work);
 }
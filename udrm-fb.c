@@ -12,167 +12,689 @@
 #include <drm/drm_fb_cma_helper.h>
 #include <drm/drm_fb_helper.h>
 #include <linux/dma-buf.h>
+#include <linux/fb.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
 
 #include <uapi/drm/udrm.h>
 
 #include "udrm.h"
+#include "udrm-trace.h"
 
-static void tinydrm_merge_clips(struct drm_clip_rect *dst,
-			 struct drm_clip_rect *src, unsigned int num_clips,
-			 unsigned int flags, u32 max_width, u32 max_height)
+/* Format of the pixels in the transfer buffer */
+static u32 udrm_fb_buf_format(struct udrm_device *udev,
+			      struct drm_framebuffer *fb)
 {
-	unsigned int i;
+	if (udev->buf_mode & UDRM_BUF_MODE_EMULATE)
+		return udev->buf_format;
 
-	if (!src || !num_clips) {
-		dst->x1 = 0;
-		dst->x2 = max_width;
-		dst->y1 = 0;
-		dst->y2 = max_height;
-		return;
-	}
+	if ((udev->buf_mode & UDRM_BUF_MODE_EMUL_XRGB8888) &&
+	    fb->pixel_format == DRM_FORMAT_XRGB8888)
+		return udev->buf_format;
 
-	dst->x1 = ~0;
-	dst->y1 = ~0;
-	dst->x2 = 0;
-	dst->y2 = 0;
+	return fb->pixel_format;
+}
 
-	for (i = 0; i < num_clips; i++) {
-		if (flags & DRM_MODE_FB_DIRTY_ANNOTATE_COPY)
-			i++;
-		dst->x1 = min(dst->x1, src[i].x1);
-		dst->x2 = max(dst->x2, src[i].x2);
-		dst->y1 = min(dst->y1, src[i].y1);
-		dst->y2 = max(dst->y2, src[i].y2);
-	}
+/* Bytes taken by @clip in the transfer buffer */
+static size_t udrm_fb_buf_clip_size(struct udrm_device *udev,
+				    struct drm_framebuffer *fb,
+				    const struct drm_clip_rect *clip)
+{
+	unsigned int bpp = udrm_buf_gray_bpp(udev->buf_mode);
 
-	if (dst->x2 > max_width || dst->y2 > max_height ||
-	    dst->x1 >= dst->x2 || dst->y1 >= dst->y2) {
-		DRM_DEBUG_KMS("Illegal clip: x1=%u, x2=%u, y1=%u, y2=%u\n",
-			      dst->x1, dst->x2, dst->y1, dst->y2);
-		dst->x1 = 0;
-		dst->y1 = 0;
-		dst->x2 = max_width;
-		dst->y2 = max_height;
-	}
+	if (bpp)
+		return DIV_ROUND_UP((clip->x2 - clip->x1) * bpp, 8) *
+		       (clip->y2 - clip->y1);
+
+	return udrm_clip_area(clip) *
+	       drm_format_plane_cpp(udrm_fb_buf_format(udev, fb), 0);
 }
 
-static void udrm_buf_memcpy(void *dst, void *vaddr, unsigned int pitch,
-			    unsigned int cpp, struct drm_clip_rect *clip)
+/*
+ * Large clips are split into row bands and converted in parallel. Below
+ * this many pixels per band the work handoff costs more than it saves.
+ */
+#define UDRM_CONV_BAND_MIN	(64 * 1024)
+
+static void udrm_fb_conv_band_work(struct work_struct *work)
 {
-	void *src = vaddr + (clip->y1 * pitch) + (clip->x1 * cpp);
-	size_t len = (clip->x2 - clip->x1) * cpp;
-	unsigned int y;
+	struct udrm_conv_band *band = container_of(work, struct udrm_conv_band,
+						   work);
 
-	for (y = clip->y1; y < clip->y2; y++) {
-		memcpy(dst, src, len);
-		src += pitch;
-		dst += len;
-	}
+	band->ret = udrm_conv_clip(band->dst, band->src, band->pitch,
+				   &band->clip, band->src_format,
+				   band->dst_format, band->swap, band->wc);
 }
 
-static void udrm_buf_swab16(u16 *dst, void *vaddr, unsigned int pitch,
-			    struct drm_clip_rect *clip)
+static int udrm_fb_conv_clip(struct udrm_device *udev, void *dst, void *src,
+			     unsigned int pitch,
+			     const struct drm_clip_rect *clip, u32 src_format,
+			     u32 dst_format, bool swap, bool wc)
 {
-	unsigned int x, y;
-	u16 *src;
+	unsigned int height = clip->y2 - clip->y1;
+	struct udrm_conv_band *band;
+	unsigned int i, y, n = 1;
+	size_t stride;
+	int ret;
 
-	for (y = clip->y1; y < clip->y2; y++) {
-		src = vaddr + (y * pitch);
-		src += clip->x1;
-		for (x = clip->x1; x < clip->x2; x++)
-			*dst++ = swab16(*src++);
+	if (udev->conv_wq)
+		n = min_t(u64, udev->num_conv_bands,
+			  udrm_clip_area(clip) / UDRM_CONV_BAND_MIN);
+	n = min(n, height);
+
+	/* The bands are shared, a concurrent flush does its own work */
+	if (n < 2 || !mutex_trylock(&udev->conv_lock))
+		return udrm_conv_clip(dst, src, pitch, clip, src_format,
+				      dst_format, swap, wc);
+
+	stride = (clip->x2 - clip->x1) * drm_format_plane_cpp(dst_format, 0);
+
+	for (i = 0, y = clip->y1; i < n; i++) {
+		band = &udev->conv_bands[i];
+		band->clip = *clip;
+		band->clip.y1 = y;
+		band->clip.y2 = clip->y1 + height * (i + 1) / n;
+		band->dst = dst + (y - clip->y1) * stride;
+		band->src = src;
+		band->pitch = pitch;
+		band->src_format = src_format;
+		band->dst_format = dst_format;
+		band->swap = swap;
+		band->wc = wc;
+		y = band->clip.y2;
+
+		/* The last band is converted here while the others run */
+		if (i < n - 1)
+			queue_work(udev->conv_wq, &band->work);
 	}
+
+	udrm_fb_conv_band_work(&band->work);
+	ret = band->ret;
+
+	for (i = 0; i < n - 1; i++) {
+		band = &udev->conv_bands[i];
+		flush_work(&band->work);
+		if (!ret)
+			ret = band->ret;
+	}
+
+	mutex_unlock(&udev->conv_lock);
+
+	return ret;
 }
 
-static void udrm_buf_emul_xrgb888(void *dst, void *vaddr, unsigned int pitch,
-			u32 buf_mode, struct drm_clip_rect *clip)
+int udrm_fb_conv_init(struct udrm_device *udev)
 {
-	bool swap = (buf_mode & 7) == UDRM_BUF_MODE_SWAP_BYTES;
-	u16 val16, *dst16 = dst;
-	unsigned int x, y;
-	u32 *src;
+	unsigned int i, n;
 
-	for (y = clip->y1; y < clip->y2; y++) {
-		src = vaddr + (y * pitch);
-		src += clip->x1;
-		for (x = clip->x1; x < clip->x2; x++) {
-			val16 = ((*src & 0x00F80000) >> 8) |
-				((*src & 0x0000FC00) >> 5) |
-				((*src & 0x000000F8) >> 3);
-			src++;
-			if (swap)
-				*dst16++ = swab16(val16);
-			else
-				*dst16++ = val16;
-		}
+	mutex_init(&udev->conv_lock);
+
+	n = min_t(unsigned int, num_online_cpus(), UDRM_CONV_MAX_BANDS);
+	if (!udev->num_bufs || n < 2)
+		return 0;
+
+	udev->conv_wq = alloc_workqueue("udrm-conv", WQ_UNBOUND, n);
+	if (!udev->conv_wq)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		INIT_WORK(&udev->conv_bands[i].work, udrm_fb_conv_band_work);
+	udev->num_conv_bands = n;
+
+	return 0;
+}
+
+void udrm_fb_conv_fini(struct udrm_device *udev)
+{
+	if (udev->conv_wq)
+		destroy_workqueue(udev->conv_wq);
+	udev->conv_wq = NULL;
+	udev->num_conv_bands = 0;
+}
+
+static void udrm_fb_buf_row_delta(struct udrm_device *udev,
+				  struct drm_framebuffer *fb, void *vaddr,
+				  const struct drm_clip_rect *clips,
+				  unsigned int num_clips, bool undo)
+{
+	unsigned int i, rows;
+	size_t len;
+
+	for (i = 0; i < num_clips; i++) {
+		len = udrm_fb_buf_clip_size(udev, fb, &clips[i]);
+		rows = clips[i].y2 - clips[i].y1;
+		udrm_conv_row_delta(vaddr, len / rows, rows, undo);
+		vaddr += len;
 	}
 }
 
-static bool udrm_fb_dirty_buf_copy(struct udrm_device *udev,
-				   struct drm_framebuffer *fb,
-				   struct drm_clip_rect *clip)
+/* The clips are packed one after the other in the transfer buffer */
+static int udrm_fb_dirty_buf_copy(struct udrm_device *udev,
+				  struct drm_framebuffer *fb,
+				  struct udrm_buf *buf,
+				  struct drm_clip_rect *clips,
+				  unsigned int num_clips)
 {
 	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
-	unsigned int cpp = drm_format_plane_cpp(fb->pixel_format, 0);
+	unsigned int gray_bpp = udrm_buf_gray_bpp(udev->buf_mode);
+	u32 buf_format = udrm_fb_buf_format(udev, fb);
 	unsigned int pitch = fb->pitches[0];
+	bool swap = (udev->buf_mode & UDRM_BUF_MODE_MASK) ==
+		    UDRM_BUF_MODE_SWAP_BYTES;
+	bool delta = udev->buf_mode & UDRM_BUF_MODE_ROW_DELTA;
 	void *dst, *src = cma_obj->vaddr;
-	int ret = 0;
+	/* CMA buffers are write-combined, imported ones are usually cached */
+	bool wc = !cma_obj->base.import_attach;
+	struct drm_clip_rect *clip;
+	unsigned int i, cpp;
+	u64 pixels = 0;
+	ktime_t start;
+	size_t len;
+	int ret = 0, end_ret;
 
 	if (cma_obj->base.import_attach) {
 		ret = dma_buf_begin_cpu_access(cma_obj->base.import_attach->dmabuf,
 					       DMA_FROM_DEVICE);
 		if (ret)
-			return false;
+			return ret;
 	}
 
-	dst = dma_buf_vmap(udev->dmabuf);
-	if (!dst) {
-		ret = -ENOMEM;
-		goto out_end_access;
+	start = ktime_get();
+
+	for (i = 0, dst = buf->scratch ?: buf->vaddr; i < num_clips && !ret;
+	     i++) {
+		clip = &clips[i];
+		pixels += udrm_clip_area(clip);
+		trace_udrm_conv_begin(udev, fb->base.id, clip);
+		if (gray_bpp)
+			ret = udrm_conv_clip_gray(dst, src, pitch, clip,
+						  fb->pixel_format, gray_bpp,
+						  udev->buf_mode, buf->line,
+						  buf->err);
+		else
+			ret = udrm_fb_conv_clip(udev, dst, src, pitch, clip,
+						fb->pixel_format, buf_format,
+						swap, wc);
+		trace_udrm_conv_end(udev, fb->base.id, clip);
+		dst += udrm_fb_buf_clip_size(udev, fb, clip);
 	}
 
-	if (udev->emulate_xrgb8888_format &&
-	    fb->pixel_format == DRM_FORMAT_XRGB8888) {
-		udrm_buf_emul_xrgb888(dst, src, pitch, udev->buf_mode, clip);
-		goto out;
+	buf->len = dst - (buf->scratch ?: buf->vaddr);
+	buf->encoding = 0;
+
+	/* Not worth it if it doesn't shrink, send it raw */
+	if (buf->scratch && !ret) {
+		if (delta)
+			udrm_fb_buf_row_delta(udev, fb, buf->scratch, clips,
+					      num_clips, false);
+		cpp = gray_bpp ? 1 : drm_format_plane_cpp(buf_format, 0);
+		len = udrm_conv_rle(buf->vaddr, buf->len, buf->scratch,
+				    buf->len, cpp);
+		if (len && len < buf->len) {
+			buf->len = len;
+			buf->encoding = udev->buf_mode &
+					(UDRM_BUF_MODE_RLE |
+					 UDRM_BUF_MODE_ROW_DELTA);
+		} else {
+			if (delta)
+				udrm_fb_buf_row_delta(udev, fb, buf->scratch,
+						      clips, num_clips, true);
+			memcpy(buf->vaddr, buf->scratch, buf->len);
+		}
 	}
 
-	switch (udev->buf_mode & 7) {
-	case UDRM_BUF_MODE_PLAIN_COPY:
-		udrm_buf_memcpy(dst, src, pitch, cpp, clip);
-		break;
-	case UDRM_BUF_MODE_SWAP_BYTES:
-		/* FIXME support more */
-		if (cpp == 2)
-			udrm_buf_swab16(dst, src, pitch, clip);
-		else
-			ret = -EINVAL;
-		break;
-	default:
-		ret = -EINVAL;
-		break;
+	udrm_stats_copy(udev, pixels, buf->len,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	if (cma_obj->base.import_attach) {
+		end_ret = dma_buf_end_cpu_access(cma_obj->base.import_attach->dmabuf,
+						 DMA_FROM_DEVICE);
+		if (!ret)
+			ret = end_ret;
 	}
-out:
-	dma_buf_vunmap(udev->dmabuf, dst);
-out_end_access:
-	if (cma_obj->base.import_attach)
-		ret = dma_buf_end_cpu_access(cma_obj->base.import_attach->dmabuf,
-					     DMA_FROM_DEVICE);
 
-	return ret ? false : true;
+	return ret;
 }
 
-static int udrm_fb_dirty(struct drm_framebuffer *fb,
-			     struct drm_file *file_priv,
-			     unsigned int flags, unsigned int color,
-			     struct drm_clip_rect *clips,
-			     unsigned int num_clips)
+/*
+ * Tile hashing keeps a hash of each tile of what's on the display, so damage
+ * that didn't actually change any pixels can be dropped from a flush.
+ * Only tiles completely inside a clip are hashed, the others are flushed and
+ * forgotten since the rest of the tile might not be on the display.
+ */
+#define UDRM_TILE_SIZE	16
+
+int udrm_fb_tile_hash_init(struct udrm_device *udev)
+{
+	unsigned int num_tiles;
+
+	udev->tiles_x = DIV_ROUND_UP(udev->display_mode.hdisplay,
+				     UDRM_TILE_SIZE);
+	udev->tiles_y = DIV_ROUND_UP(udev->display_mode.vdisplay,
+				     UDRM_TILE_SIZE);
+	num_tiles = udev->tiles_x * udev->tiles_y;
+
+	udev->tile_hash = kcalloc(num_tiles, sizeof(*udev->tile_hash),
+				  GFP_KERNEL);
+	udev->tile_valid = kcalloc(BITS_TO_LONGS(num_tiles),
+				   sizeof(unsigned long), GFP_KERNEL);
+	if (!udev->tile_hash || !udev->tile_valid) {
+		udrm_fb_tile_hash_fini(udev);
+		return -ENOMEM;
+	}
+
+	mutex_init(&udev->tile_lock);
+
+	return 0;
+}
+
+void udrm_fb_tile_hash_fini(struct udrm_device *udev)
+{
+	kfree(udev->tile_hash);
+	kfree(udev->tile_valid);
+	udev->tile_hash = NULL;
+	udev->tile_valid = NULL;
+}
+
+/* Forget the tiles touched by @clip, or all of them if @clip is NULL */
+static void udrm_fb_tile_invalidate(struct udrm_device *udev,
+				    const struct drm_clip_rect *clip)
+{
+	unsigned int tx, ty;
+
+	if (!udev->tile_hash)
+		return;
+
+	mutex_lock(&udev->tile_lock);
+	if (!clip) {
+		bitmap_zero(udev->tile_valid, udev->tiles_x * udev->tiles_y);
+	} else {
+		for (ty = clip->y1 / UDRM_TILE_SIZE;
+		     ty <= (clip->y2 - 1) / UDRM_TILE_SIZE; ty++)
+			for (tx = clip->x1 / UDRM_TILE_SIZE;
+			     tx <= (clip->x2 - 1) / UDRM_TILE_SIZE; tx++)
+				clear_bit(ty * udev->tiles_x + tx,
+					  udev->tile_valid);
+	}
+	mutex_unlock(&udev->tile_lock);
+}
+
+static u32 udrm_fb_tile_hash(void *vaddr, unsigned int pitch,
+			     unsigned int cpp, const struct drm_clip_rect *tile)
+{
+	void *src = vaddr + (tile->y1 * pitch) + (tile->x1 * cpp);
+	u32 len = (tile->x2 - tile->x1) * cpp;
+	unsigned int y;
+	u32 hash = 0;
+
+	for (y = tile->y1; y < tile->y2; y++) {
+		hash = jhash(src, len, hash);
+		src += pitch;
+	}
+
+	return hash;
+}
+
+/*
+ * Check if the tile at @tx, @ty has changed and store its new hash.
+ * @tile is set to the tile rectangle. Must be called with tile_lock held.
+ */
+static bool udrm_fb_tile_changed(struct udrm_device *udev,
+				 struct drm_framebuffer *fb, void *vaddr,
+				 const struct drm_clip_rect *clip,
+				 unsigned int tx, unsigned int ty,
+				 struct drm_clip_rect *tile)
+{
+	unsigned int cpp = drm_format_plane_cpp(fb->pixel_format, 0);
+	unsigned int idx = ty * udev->tiles_x + tx;
+	bool changed;
+	u32 hash;
+
+	tile->x1 = tx * UDRM_TILE_SIZE;
+	tile->y1 = ty * UDRM_TILE_SIZE;
+	tile->x2 = min_t(u32, tile->x1 + UDRM_TILE_SIZE, fb->width);
+	tile->y2 = min_t(u32, tile->y1 + UDRM_TILE_SIZE, fb->height);
+
+	if (tile->x1 < clip->x1 || tile->x2 > clip->x2 ||
+	    tile->y1 < clip->y1 || tile->y2 > clip->y2) {
+		clear_bit(idx, udev->tile_valid);
+		return true;
+	}
+
+	hash = udrm_fb_tile_hash(vaddr, fb->pitches[0], cpp, tile);
+	changed = !test_bit(idx, udev->tile_valid) ||
+		  udev->tile_hash[idx] != hash;
+	udev->tile_hash[idx] = hash;
+	set_bit(idx, udev->tile_valid);
+
+	return changed;
+}
+
+/*
+ * Reduce @clips to the tiles that have changed since they were last
+ * flushed. Returns the new number of clips, zero if nothing changed.
+ */
+static unsigned int udrm_fb_tile_filter(struct udrm_device *udev,
+					struct drm_framebuffer *fb,
+					struct drm_clip_rect *clips,
+					unsigned int num_clips)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct dma_buf *dmabuf = cma_obj->base.import_attach ?
+				 cma_obj->base.import_attach->dmabuf : NULL;
+	struct drm_clip_rect changed[UDRM_MAX_CLIPS + 1];
+	struct drm_clip_rect *clip, tile, run;
+	unsigned int i, tx, ty, last_tx, n = 0;
+	bool in_run;
+
+	if (dmabuf && dma_buf_begin_cpu_access(dmabuf, DMA_FROM_DEVICE))
+		return num_clips;
+
+	mutex_lock(&udev->tile_lock);
+
+	for (i = 0; i < num_clips; i++) {
+		clip = &clips[i];
+		last_tx = (clip->x2 - 1) / UDRM_TILE_SIZE;
+
+		for (ty = clip->y1 / UDRM_TILE_SIZE;
+		     ty <= (clip->y2 - 1) / UDRM_TILE_SIZE; ty++) {
+			in_run = false;
+			for (tx = clip->x1 / UDRM_TILE_SIZE; tx <= last_tx; tx++) {
+				if (udrm_fb_tile_changed(udev, fb, cma_obj->vaddr,
+							 clip, tx, ty, &tile)) {
+					if (!in_run) {
+						run.x1 = max(tile.x1, clip->x1);
+						run.y1 = max(tile.y1, clip->y1);
+						run.y2 = min(tile.y2, clip->y2);
+						in_run = true;
+					}
+					run.x2 = min(tile.x2, clip->x2);
+					if (tx != last_tx)
+						continue;
+				}
+
+				/* Runs of changed tiles become one clip */
+				if (in_run) {
+					udrm_clip_add(changed, &n,
+						      udev->max_clips,
+						      udev->clip_cost, &run);
+					in_run = false;
+				}
+			}
+		}
+	}
+
+	mutex_unlock(&udev->tile_lock);
+
+	if (dmabuf)
+		dma_buf_end_cpu_access(dmabuf, DMA_FROM_DEVICE);
+
+	memcpy(clips, changed, n * sizeof(*clips));
+
+	return n;
+}
+
+static int udrm_fb_send_clips(struct drm_framebuffer *fb, u32 type,
+			      unsigned int flags, unsigned int color,
+			      struct drm_clip_rect *clips,
+			      unsigned int num_clips, struct udrm_buf *buf,
+			      struct udrm_event_reply *reply)
 {
 	struct udrm_device *udev = drm_to_udrm(fb->dev);
+	u64 ev_buf[DIV_ROUND_UP(UDRM_EVENT_MAX_SIZE, sizeof(u64))];
 	struct drm_mode_fb_dirty_cmd *dirty;
 	struct udrm_event_fb_dirty *ev;
-	struct drm_clip_rect clip;
 	size_t size_clips, size;
+	unsigned int i;
+
+	size_clips = num_clips * sizeof(struct drm_clip_rect);
+	size = sizeof(struct udrm_event_fb_dirty) + size_clips;
+
+	/* Callers cap num_clips at UDRM_MAX_CLIPS */
+	if (WARN_ON(size > sizeof(ev_buf)))
+		return -EINVAL;
+
+	ev = (struct udrm_event_fb_dirty *)ev_buf;
+	memset(ev, 0, size);
+
+	ev->base.type = type;
+	ev->base.length = size;
+	dirty = &ev->fb_dirty_cmd;
+
+	dirty->fb_id = fb->base.id;
+	dirty->flags = flags;
+	dirty->color = color;
+	dirty->num_clips = num_clips;
+
+	if (buf) {
+		ev->buf_index = buf - udev->bufs;
+		ev->buf_age = buf->age;
+		ev->buf_len = buf->len;
+		ev->buf_encoding = buf->encoding;
+	}
+
+	memcpy(ev->clips, clips, size_clips);
+
+	/* Copies and fills change the display behind the tile hashes */
+	if (type == UDRM_EVENT_FB_COPY)
+		for (i = 1; i < num_clips; i += 2)
+			udrm_fb_tile_invalidate(udev, &clips[i]);
+	else if (type == UDRM_EVENT_FB_FILL)
+		for (i = 0; i < num_clips; i++)
+			udrm_fb_tile_invalidate(udev, &clips[i]);
+
+	return udrm_send_event_reply(udev, ev, reply);
+}
+
+/*
+ * Send the copies and fills queued by the fbdev hooks. This is also done
+ * before flushing the fbdev framebuffer so they reach the display before
+ * any damage that comes after them.
+ */
+static void udrm_fbdev_flush_ops(struct udrm_device *udev)
+{
+	struct udrm_fbdev_op ops[UDRM_FBDEV_MAX_OPS], *op;
+	struct drm_framebuffer *fb;
+	unsigned int i, num_ops;
+	unsigned long flags;
+	int ret;
+
+	mutex_lock(&udev->fbdev_op_lock);
+
+	spin_lock_irqsave(&udev->fbdev_op_slock, flags);
+	num_ops = udev->num_fbdev_ops;
+	memcpy(ops, udev->fbdev_ops, num_ops * sizeof(*ops));
+	udev->num_fbdev_ops = 0;
+	spin_unlock_irqrestore(&udev->fbdev_op_slock, flags);
+
+	fb = udev->fbdev_helper ? udev->fbdev_helper->fb : NULL;
+
+	for (i = 0; i < num_ops; i++) {
+		op = &ops[i];
+
+		/* A modeset will flush everything anyway */
+		if (!fb || !udev->prepared || udev->pipe.plane.fb != fb)
+			break;
+
+		if (op->type == UDRM_EVENT_FB_COPY)
+			ret = udrm_fb_send_clips(fb, op->type,
+						 DRM_MODE_FB_DIRTY_ANNOTATE_COPY,
+						 0, op->clips, 2, NULL, NULL);
+		else
+			ret = udrm_fb_send_clips(fb, op->type,
+						 DRM_MODE_FB_DIRTY_ANNOTATE_FILL,
+						 op->color, op->clips, 1, NULL, NULL);
+		if (ret) {
+			/* The display is out of sync, flush everything */
+			udev->enabled = false;
+			break;
+		}
+	}
+
+	mutex_unlock(&udev->fbdev_op_lock);
+}
+
+void udrm_fbdev_op_work(struct work_struct *work)
+{
+	struct udrm_device *udev = container_of(work, struct udrm_device,
+						fbdev_op_work);
+
+	udrm_fbdev_flush_ops(udev);
+}
+
+/*
+ * Can be called in atomic context. Returns false if the operation has to go
+ * through the regular damage path.
+ */
+static bool udrm_fbdev_queue_op(struct fb_info *info, u32 type, u32 color,
+				const struct drm_clip_rect *clips,
+				unsigned int num_clips)
+{
+	struct drm_fb_helper *helper = info->par;
+	struct udrm_device *udev = drm_to_udrm(helper->dev);
+	struct drm_framebuffer *fb = helper->fb;
+	struct udrm_fbdev_op *op;
+	unsigned long flags;
+	bool idle, queued = false;
+	unsigned int i;
+
+	if (!udev->enabled || udev->pipe.plane.fb != fb)
+		return false;
+
+	for (i = 0; i < num_clips; i++)
+		if (!udrm_clip_valid(&clips[i], fb->width, fb->height))
+			return false;
+
+	/* Damage that's not on the display yet could be copied from */
+	spin_lock_irqsave(&helper->dirty_lock, flags);
+	idle = helper->dirty_clip.x1 >= helper->dirty_clip.x2 &&
+	       !work_busy(&helper->dirty_work);
+	spin_unlock_irqrestore(&helper->dirty_lock, flags);
+
+	if (!idle || READ_ONCE(udev->damage_fb) || work_busy(&udev->flush_work))
+		return false;
+
+	spin_lock_irqsave(&udev->fbdev_op_slock, flags);
+	if (udev->num_fbdev_ops < UDRM_FBDEV_MAX_OPS) {
+		op = &udev->fbdev_ops[udev->num_fbdev_ops++];
+		op->type = type;
+		op->color = color;
+		memcpy(op->clips, clips, num_clips * sizeof(*clips));
+		queued = true;
+	}
+	spin_unlock_irqrestore(&udev->fbdev_op_slock, flags);
+
+	if (queued)
+		udrm_queue_work(udev, &udev->fbdev_op_work);
+
+	return queued;
+}
+
+static void udrm_fbdev_copyarea(struct fb_info *info,
+				const struct fb_copyarea *area)
+{
+	struct drm_clip_rect clips[2] = {
+		{
+			.x1 = area->sx,
+			.y1 = area->sy,
+			.x2 = area->sx + area->width,
+			.y2 = area->sy + area->height,
+		}, {
+			.x1 = area->dx,
+			.y1 = area->dy,
+			.x2 = area->dx + area->width,
+			.y2 = area->dy + area->height,
+		},
+	};
+
+	if (udrm_fbdev_queue_op(info, UDRM_EVENT_FB_COPY, 0, clips, 2))
+		sys_copyarea(info, area);
+	else
+		drm_fb_helper_sys_copyarea(info, area);
+}
+
+static void udrm_fbdev_fillrect(struct fb_info *info,
+				const struct fb_fillrect *rect)
+{
+	struct drm_clip_rect clip = {
+		.x1 = rect->dx,
+		.y1 = rect->dy,
+		.x2 = rect->dx + rect->width,
+		.y2 = rect->dy + rect->height,
+	};
+	u32 color = rect->color;
+
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR ||
+	    info->fix.visual == FB_VISUAL_DIRECTCOLOR)
+		color = ((u32 *)info->pseudo_palette)[rect->color];
+
+	if (rect->rop == ROP_COPY &&
+	    udrm_fbdev_queue_op(info, UDRM_EVENT_FB_FILL, color, &clip, 1))
+		sys_fillrect(info, rect);
+	else
+		drm_fb_helper_sys_fillrect(info, rect);
+}
+
+static void udrm_fbdev_cancel_ops(struct udrm_device *udev)
+{
+	cancel_work_sync(&udev->fbdev_op_work);
+	udev->num_fbdev_ops = 0;
+}
+
+/*
+ * Forward a copy or fill annotated DIRTYFB as is. Returns false if it has
+ * to be flushed as damage instead.
+ */
+static bool udrm_fb_dirty_annotated(struct drm_framebuffer *fb,
+				    unsigned int flags, unsigned int color,
+				    struct drm_clip_rect *clips,
+				    unsigned int num_clips)
+{
+	struct udrm_device *udev = drm_to_udrm(fb->dev);
+	bool copy = flags & DRM_MODE_FB_DIRTY_ANNOTATE_COPY;
+	unsigned int i;
+	int ret;
+
+	if (!(udev->flags & UDRM_DEV_FLAG_COPY_FILL) ||
+	    (flags & DRM_MODE_FB_DIRTY_FLAGS) == DRM_MODE_FB_DIRTY_FLAGS)
+		return false;
+
+	/* Copying is only correct if the display is up to date */
+	if (!udev->enabled || !clips || !num_clips ||
+	    num_clips > UDRM_MAX_CLIPS || (copy && num_clips % 2))
+		return false;
+
+	for (i = 0; i < num_clips; i++) {
+		if (!udrm_clip_valid(&clips[i], fb->width, fb->height))
+			return false;
+		if (copy && (i % 2) &&
+		    !udrm_clip_same_size(&clips[i], &clips[i - 1]))
+			return false;
+	}
+
+	if ((udev->flags & UDRM_DEV_FLAG_ASYNC_DIRTY) &&
+	    (READ_ONCE(udev->damage_fb) || work_busy(&udev->flush_work)))
+		return false;
+
+	ret = udrm_fb_send_clips(fb, copy ? UDRM_EVENT_FB_COPY :
+				 UDRM_EVENT_FB_FILL,
+				 flags & DRM_MODE_FB_DIRTY_FLAGS, color,
+				 clips, num_clips, NULL, NULL);
+	if (ret)
+		DRM_DEBUG("Failed to send annotated flush %d\n", ret);
+
+	return !ret;
+}
+
+static int udrm_fb_do_flush(struct drm_framebuffer *fb, unsigned int flags,
+			    unsigned int color, struct drm_clip_rect *clips,
+			    unsigned int num_clips, ktime_t *timestamp)
+{
+	struct udrm_device *udev = drm_to_udrm(fb->dev);
+	struct drm_clip_rect merged[UDRM_MAX_CLIPS + 1];
+	struct udrm_event_reply reply;
+	struct udrm_buf *buf = NULL;
+	unsigned int i, gray_bpp;
 	int ret;
 
 	/* don't return -EINVAL, xorg will stop flushing */
@@ -183,54 +705,241 @@ static int udrm_fb_dirty(struct drm_framebuffer *fb,
 	if (udev->pipe.plane.fb != fb)
 		return 0;
 
+	/* Nobody to flush to, it's done in full on reattach */
+	if (!udev->initialized)
+		return 0;
+
 	/* Make sure to flush everything the first time */
 	if (!udev->enabled) {
 		clips = NULL;
 		num_clips = 0;
+		udrm_fb_tile_invalidate(udev, NULL);
 	}
 
 	udev->enabled = true;
 
+	if (udev->fbdev_helper && fb == udev->fbdev_helper->fb)
+		udrm_fbdev_flush_ops(udev);
+
+	num_clips = udrm_merge_clips(merged, udev->max_clips, udev->clip_cost,
+				     clips, num_clips, flags,
+				     fb->width, fb->height);
+	clips = merged;
+
+	if (udev->tile_hash) {
+		num_clips = udrm_fb_tile_filter(udev, fb, clips, num_clips);
+		if (!num_clips) {
+			udrm_stats_inc(udev, flushes_dropped);
+			DRM_DEBUG("[FB:%d] unchanged, skipping flush\n",
+				  fb->base.id);
+			return 0;
+		}
+	}
+
+	/* Packed grayscale is sent in whole bytes */
+	gray_bpp = udrm_buf_gray_bpp(udev->buf_mode);
+	if (gray_bpp && gray_bpp < 8) {
+		for (i = 0; i < num_clips; i++) {
+			clips[i].x1 = round_down(clips[i].x1, 8 / gray_bpp);
+			clips[i].x2 = min_t(u32, round_up(clips[i].x2,
+							  8 / gray_bpp),
+					    fb->width);
+		}
+	}
+
+	/* Overlapping clips might not fit, fall back to the bounding box */
+	if (udev->num_bufs && num_clips > 1) {
+		u64 len = 0;
+
+		for (i = 0; i < num_clips; i++)
+			len += udrm_fb_buf_clip_size(udev, fb, &clips[i]);
+		if (len > udev->buf_size) {
+			for (i = 1; i < num_clips; i++)
+				udrm_clip_union(&clips[0], &clips[i]);
+			num_clips = 1;
+		}
+	}
+
+	for (i = 0; i < num_clips; i++)
+		DRM_DEBUG("Flushing [FB:%d] x1=%u, x2=%u, y1=%u, y2=%u\n",
+			  fb->base.id, clips[i].x1, clips[i].x2,
+			  clips[i].y1, clips[i].y2);
+
 	/*
-	 * FIXME: are there any apps/libs that pass more than one clip rect?
-	 *        should we support passing multi clips to the driver?
+	 * A transfer buffer is owned by userspace until it has replied or
+	 * released it, so with more than one buffer the next flush can be
+	 * copied while the previous one is still being sent.
 	 */
-	tinydrm_merge_clips(&clip, clips, num_clips, flags,
-			    fb->width, fb->height);
-	clips = &clip;
-	num_clips = 1;
+	if (udev->num_bufs) {
+		buf = udrm_buf_acquire(udev);
+		if (IS_ERR(buf)) {
+			ret = PTR_ERR(buf);
+			goto err_resync;
+		}
+		ret = udrm_fb_dirty_buf_copy(udev, fb, buf, clips, num_clips);
+		if (ret) {
+			udrm_buf_done(udev, buf, false);
+			goto err_resync;
+		}
+	}
 
-	DRM_DEBUG("Flushing [FB:%d] x1=%u, x2=%u, y1=%u, y2=%u\n", fb->base.id,
-		  clips->x1, clips->x2, clips->y1, clips->y2);
+	/* The clips are merged, so they no longer describe a copy or fill */
+	ret = udrm_fb_send_clips(fb, UDRM_EVENT_FB_DIRTY,
+				 flags & ~DRM_MODE_FB_DIRTY_FLAGS, color,
+				 clips, num_clips, buf, &reply);
+	if (buf)
+		udrm_buf_done(udev, buf,
+			      !ret && (reply.flags & UDRM_REPLY_BUF_RETAIN));
+	if (ret)
+		goto err_resync;
 
-	if (udev->dmabuf && num_clips == 1)
-		udrm_fb_dirty_buf_copy(udev, fb, clips);
+	if (timestamp && (reply.flags & UDRM_REPLY_TIMESTAMP))
+		*timestamp = ns_to_ktime(reply.timestamp_ns);
 
-	size_clips = num_clips * sizeof(struct drm_clip_rect);
-	size = sizeof(struct udrm_event_fb_dirty) + size_clips;
-	ev = kzalloc(size, GFP_KERNEL);
-	if (!ev)
-		return -ENOMEM;
+	udrm_stats_inc(udev, flushes);
 
-	ev->base.type = UDRM_EVENT_FB_DIRTY;
-	ev->base.length = size;
-	dirty = &ev->fb_dirty_cmd;
+	return 0;
 
-	dirty->fb_id = fb->base.id;
-	dirty->flags = flags;
-	dirty->color = color;
-	dirty->num_clips = num_clips;
+err_resync:
+	/* The damage is lost, flush everything next time */
+	pr_err_ratelimited("Failed to update display %d\n", ret);
+	udrm_fb_tile_invalidate(udev, NULL);
+	udev->enabled = false;
 
-	if (num_clips)
-		memcpy(ev->clips, clips, size_clips);
+	return ret;
+}
 
-	ret = udrm_send_event(udev, ev);
-	if (ret)
-		pr_err_ratelimited("Failed to update display %d\n", ret);
+int udrm_fb_flush(struct drm_framebuffer *fb, unsigned int flags,
+		  unsigned int color, struct drm_clip_rect *clips,
+		  unsigned int num_clips, ktime_t *timestamp)
+{
+	struct udrm_device *udev = drm_to_udrm(fb->dev);
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	bool vmap = udev->num_bufs || udev->tile_hash;
+	int ret;
+
+	/* Only the copy and the tile hashes read the pixels */
+	if (vmap) {
+		ret = udrm_gem_vmap_get(udev, cma_obj);
+		if (ret)
+			return ret;
+	}
+
+	ret = udrm_fb_do_flush(fb, flags, color, clips, num_clips, timestamp);
+
+	if (vmap)
+		udrm_gem_vmap_put(udev, cma_obj);
 
 	return ret;
 }
 
+void udrm_fb_flush_work(struct work_struct *work)
+{
+	struct udrm_device *udev = container_of(work, struct udrm_device,
+						flush_work);
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS + 1];
+	struct drm_framebuffer *fb;
+	unsigned int num_clips;
+
+	/* Keep accumulating until userspace releases a buffer */
+	if (udev->num_bufs && !udrm_buf_available(udev))
+		return;
+
+	spin_lock(&udev->damage_lock);
+	fb = udev->damage_fb;
+	num_clips = udev->num_damage;
+	memcpy(clips, udev->damage, num_clips * sizeof(*clips));
+	udev->damage_fb = NULL;
+	udev->num_damage = 0;
+	spin_unlock(&udev->damage_lock);
+
+	if (!fb)
+		return;
+
+	trace_udrm_flush_work_begin(udev, fb->base.id);
+	udrm_fb_flush(fb, 0, 0, clips, num_clips, NULL);
+	trace_udrm_flush_work_end(udev, fb->base.id);
+	drm_framebuffer_unreference(fb);
+}
+
+void udrm_fb_flush_cancel(struct udrm_device *udev)
+{
+	cancel_work_sync(&udev->flush_work);
+	if (udev->damage_fb) {
+		drm_framebuffer_unreference(udev->damage_fb);
+		udev->damage_fb = NULL;
+		udev->num_damage = 0;
+	}
+}
+
+/*
+ * Fold the clips into the pending damage and let the flush worker send it.
+ * Damage that arrives while a transfer is in progress is coalesced into the
+ * next flush.
+ */
+static void udrm_fb_dirty_async(struct drm_framebuffer *fb,
+				unsigned int flags, struct drm_clip_rect *clips,
+				unsigned int num_clips)
+{
+	struct udrm_device *udev = drm_to_udrm(fb->dev);
+	struct drm_clip_rect merged[UDRM_MAX_CLIPS + 1];
+	struct drm_framebuffer *old_fb = NULL;
+	unsigned int i;
+
+	/* Make sure to flush everything the first time */
+	if (!udev->enabled) {
+		clips = NULL;
+		num_clips = 0;
+	}
+
+	num_clips = udrm_merge_clips(merged, udev->max_clips, udev->clip_cost,
+				     clips, num_clips, flags,
+				     fb->width, fb->height);
+
+	spin_lock(&udev->damage_lock);
+	if (udev->damage_fb != fb) {
+		/* Damage on a framebuffer that's no longer scanned out */
+		old_fb = udev->damage_fb;
+		drm_framebuffer_reference(fb);
+		udev->damage_fb = fb;
+		udev->num_damage = 0;
+	} else if (udev->num_damage) {
+		udrm_stats_inc(udev, flushes_coalesced);
+	}
+	for (i = 0; i < num_clips; i++)
+		udrm_clip_add(udev->damage, &udev->num_damage, udev->max_clips,
+			      udev->clip_cost, &merged[i]);
+	spin_unlock(&udev->damage_lock);
+
+	if (old_fb)
+		drm_framebuffer_unreference(old_fb);
+
+	udrm_queue_work(udev, &udev->flush_work);
+}
+
+static int udrm_fb_dirty(struct drm_framebuffer *fb,
+			     struct drm_file *file_priv,
+			     unsigned int flags, unsigned int color,
+			     struct drm_clip_rect *clips,
+			     unsigned int num_clips)
+{
+	struct udrm_device *udev = drm_to_udrm(fb->dev);
+
+	if (!udev->prepared || udev->pipe.plane.fb != fb)
+		return 0;
+
+	if ((flags & DRM_MODE_FB_DIRTY_FLAGS) &&
+	    udrm_fb_dirty_annotated(fb, flags, color, clips, num_clips))
+		return 0;
+
+	if (!(udev->flags & UDRM_DEV_FLAG_ASYNC_DIRTY))
+		return udrm_fb_flush(fb, flags, color, clips, num_clips, NULL);
+
+	udrm_fb_dirty_async(fb, flags, clips, num_clips);
+
+	return 0;
+}
+
 static void udrm_fb_destroy(struct drm_framebuffer *fb)
 {
 	struct udrm_device *udev = drm_to_udrm(fb->dev);
@@ -239,6 +948,7 @@ static void udrm_fb_destroy(struct drm_framebuffer *fb)
 			.type = UDRM_EVENT_FB_DESTROY,
 			.length = sizeof(ev),
 		},
+		.buf_fd = -1,
 	};
 	struct drm_framebuffer *iter;
 	int id;
@@ -269,7 +979,54 @@ static const struct drm_framebuffer_funcs udrm_fb_funcs = {
 	.dirty		= udrm_fb_dirty,
 };
 
-static int udrm_fb_create_event(struct drm_framebuffer *fb)
+/*
+ * Userspace reads the framebuffer itself in zero-copy mode. Like
+ * drm_gem_prime_handle_to_fd() each object is exported once and the dma-buf
+ * cached in &drm_gem_object->dma_buf, where the last handle drops it.
+ */
+static struct dma_buf *udrm_fb_export(struct drm_framebuffer *fb)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct drm_gem_object *obj = &cma_obj->base;
+	struct drm_device *drm = fb->dev;
+	struct dma_buf *dmabuf;
+
+	mutex_lock(&drm->object_name_lock);
+
+	if (obj->import_attach) {
+		dmabuf = obj->import_attach->dmabuf;
+		get_dma_buf(dmabuf);
+		goto out_unlock;
+	}
+
+	if (obj->dma_buf) {
+		dmabuf = obj->dma_buf;
+		get_dma_buf(dmabuf);
+		goto out_unlock;
+	}
+
+	/* Dropped by drm_gem_dmabuf_release(), the export doesn't take one */
+	drm_gem_object_reference(obj);
+	dmabuf = drm_gem_prime_export(drm, obj, O_RDWR);
+	if (IS_ERR(dmabuf)) {
+		/* The framebuffer still holds a reference */
+		drm_gem_object_unreference_unlocked(obj);
+		goto out_unlock;
+	}
+
+	/* Without a handle nothing would drop the cached reference */
+	if (obj->handle_count) {
+		obj->dma_buf = dmabuf;
+		get_dma_buf(dmabuf);
+	}
+
+out_unlock:
+	mutex_unlock(&drm->object_name_lock);
+
+	return dmabuf;
+}
+
+static int udrm_fb_send_create(struct drm_framebuffer *fb)
 {
 	struct udrm_device *udev = drm_to_udrm(fb->dev);
 	struct udrm_event_fb ev = {
@@ -278,7 +1035,31 @@ static int udrm_fb_create_event(struct drm_framebuffer *fb)
 			.length = sizeof(ev),
 		},
 		.fb_id = fb->base.id,
+		.buf_fd = -1,
+		.width = fb->width,
+		.height = fb->height,
+		.pitch = fb->pitches[0],
+		.format = fb->pixel_format,
 	};
+	struct dma_buf *dmabuf = NULL;
+	int ret;
+
+	if ((udev->buf_mode & UDRM_BUF_MODE_MASK) == UDRM_BUF_MODE_ZERO_COPY) {
+		dmabuf = udrm_fb_export(fb);
+		if (IS_ERR(dmabuf))
+			return PTR_ERR(dmabuf);
+	}
+
+	ret = udrm_send_event_dmabuf(udev, &ev, dmabuf);
+	if (dmabuf)
+		dma_buf_put(dmabuf);
+
+	return ret;
+}
+
+static int udrm_fb_create_event(struct drm_framebuffer *fb)
+{
+	struct udrm_device *udev = drm_to_udrm(fb->dev);
 	int ret;
 
 	DRM_DEBUG_KMS("[FB:%d]\n", fb->base.id);
@@ -290,9 +1071,38 @@ static int udrm_fb_create_event(struct drm_framebuffer *fb)
 		return ret;
 	}
 
-	ret = udrm_send_event(udev, &ev);
+	/* Kept on failure, a reattached driver still gets FB_DESTROY */
+	return udrm_fb_send_create(fb);
+}
 
-	return ret;
+/* Announce all framebuffers to a userspace driver that has just attached */
+int udrm_fb_replay(struct udrm_device *udev)
+{
+	struct drm_mode_config *config = &udev->drm.mode_config;
+	struct drm_framebuffer **fbs, *fb;
+	unsigned int i, num_fbs = 0;
+
+	mutex_lock(&config->fb_lock);
+	fbs = kmalloc_array(config->num_fb, sizeof(*fbs), GFP_KERNEL);
+	if (fbs) {
+		/* Skip the ones already on their way to destroy */
+		drm_for_each_fb(fb, &udev->drm)
+			if (kref_get_unless_zero(&fb->base.refcount))
+				fbs[num_fbs++] = fb;
+	}
+	mutex_unlock(&config->fb_lock);
+
+	if (!fbs)
+		return -ENOMEM;
+
+	for (i = 0; i < num_fbs; i++) {
+		DRM_DEBUG_KMS("[FB:%d]\n", fbs[i]->base.id);
+		udrm_fb_send_create(fbs[i]);
+		drm_framebuffer_unreference(fbs[i]);
+	}
+	kfree(fbs);
+
+	return 0;
 }
 
 struct drm_framebuffer *
@@ -328,6 +1138,16 @@ static int udrm_fbdev_create(struct drm_fb_helper *helper,
 	strncpy(helper->fbdev->fix.id, helper->dev->driver->name, 16);
 	udev->fbdev_helper = helper;
 
+	if (udev->flags & UDRM_DEV_FLAG_COPY_FILL) {
+		struct fb_info *info = helper->fbdev;
+
+		/* The deferred io setup has given us our own copy of fb_ops */
+		info->fbops->fb_copyarea = udrm_fbdev_copyarea;
+		info->fbops->fb_fillrect = udrm_fbdev_fillrect;
+		/* Make fbcon scroll using copyarea instead of redrawing */
+		info->flags |= FBINFO_HWACCEL_COPYAREA | FBINFO_HWACCEL_FILLRECT;
+	}
+
 	DRM_DEBUG_KMS("fbdev: [FB:%d] pixel_format=%s\n", helper->fb->base.id,
 		      drm_get_format_name(helper->fb->pixel_format));
 
@@ -363,6 +1183,7 @@ int udrm_fbdev_init(struct udrm_device *udev)
 
 void udrm_fbdev_fini(struct udrm_device *udev)
 {
+	udrm_fbdev_cancel_ops(udev);
 	drm_fbdev_cma_fini(udev->fbdev_cma);
 	udev->fbdev_cma = NULL;
 	udev->fbdev_helper = NULL;
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * NEON pixel conversion, built with NEON_FLAGS like lib/raid6/neon*.c.
+ * Kernel headers clash with arm_neon.h, so only use its types here and
+ * call between kernel_neon_begin() and kernel_neon_end() from udrm-conv.c.
+ */
+
+#include <arm_neon.h>
+
+void udrm_neon_rgb565(uint16_t *dst, const uint32_t *src, unsigned int len,
+		      int swap);
+void udrm_neon_swab16(uint16_t *dst, const uint16_t *src, unsigned int len);
+
+void udrm_neon_rgb565(uint16_t *dst, const uint32_t *src, unsigned int len,
+		      int swap)
+{
+	uint8x8x4_t px;
+	uint16x8_t r, g, b, val;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		/* XRGB8888 is B, G, R, X in memory */
+		px = vld4_u8((const uint8_t *)src);
+		r = vshll_n_u8(px.val[2], 8);
+		g = vshll_n_u8(px.val[1], 8);
+		b = vshll_n_u8(px.val[0], 8);
+		val = vsriq_n_u16(r, g, 5);
+		val = vsriq_n_u16(val, b, 11);
+		if (swap)
+			val = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(val)));
+		vst1q_u16(dst, val);
+	}
+}
+
+void udrm_neon_swab16(uint16_t *dst, const uint16_t *src, unsigned int len)
+{
+	uint8x16_t val;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		val = vld1q_u8((const uint8_t *)src);
+		vst1q_u8((uint8_t *)dst, vrev16q_u8(val));
+	}
+}
@@ -79,6 +79,7 @@ static void udrm_display_pipe_enable(struct drm_simple_display_pipe *pipe,
 	DRM_DEBUG_KMS("\n");
 	udev->prepared = true;
 	udrm_send_event(udev, &ev);
+	drm_crtc_vblank_on(&pipe->crtc);
 }
 
 static void udrm_display_pipe_disable(struct drm_simple_display_pipe *pipe)
@@ -90,26 +91,92 @@ static void udrm_display_pipe_disable(struct drm_simple_display_pipe *pipe)
 	};
 
 	DRM_DEBUG_KMS("\n");
+	drm_crtc_vblank_off(&pipe->crtc);
 	udev->prepared = false;
 	udev->enabled = false;
 	udrm_send_event(udev, &ev);
 }
 
+/*
+ * Same layout as struct drm_mode_rect used by the FB_DAMAGE_CLIPS property
+ * in newer kernels, so atomic compositors can use it as is.
+ */
+struct udrm_damage_rect {
+	__s32 x1;
+	__s32 y1;
+	__s32 x2;
+	__s32 y2;
+};
+
+struct udrm_plane_state {
+	struct drm_plane_state base;
+	struct drm_property_blob *fb_damage_clips;
+};
+
+static inline struct udrm_plane_state *
+to_udrm_plane_state(struct drm_plane_state *state)
+{
+	return container_of(state, struct udrm_plane_state, base);
+}
+
+/*
+ * Get the damage set on the plane in this commit, clipped to the
+ * framebuffer. Returns the number of clips, zero if there's no damage.
+ */
+static unsigned int udrm_plane_damage(struct drm_plane_state *state,
+				      struct drm_clip_rect *clips)
+{
+	struct drm_property_blob *blob = to_udrm_plane_state(state)->fb_damage_clips;
+	struct drm_framebuffer *fb = state->fb;
+	struct udrm_damage_rect *rects;
+	struct drm_clip_rect clip;
+	unsigned int i, n = 0;
+
+	if (!blob || !fb)
+		return 0;
+
+	rects = blob->data;
+	for (i = 0; i < blob->length / sizeof(*rects); i++) {
+		clip.x1 = clamp_t(s32, rects[i].x1, 0, fb->width);
+		clip.x2 = clamp_t(s32, rects[i].x2, 0, fb->width);
+		clip.y1 = clamp_t(s32, rects[i].y1, 0, fb->height);
+		clip.y2 = clamp_t(s32, rects[i].y2, 0, fb->height);
+		if (clip.x1 >= clip.x2 || clip.y1 >= clip.y2)
+			continue;
+
+		/* The flush merges them further, just make them fit */
+		if (n == UDRM_MAX_CLIPS) {
+			clips[n - 1].x1 = min(clips[n - 1].x1, clip.x1);
+			clips[n - 1].x2 = max(clips[n - 1].x2, clip.x2);
+			clips[n - 1].y1 = min(clips[n - 1].y1, clip.y1);
+			clips[n - 1].y2 = max(clips[n - 1].y2, clip.y2);
+		} else {
+			clips[n++] = clip;
+		}
+	}
+
+	return n;
+}
+
 static void udrm_display_pipe_update(struct drm_simple_display_pipe *pipe,
 				 struct drm_plane_state *old_state)
 {
 	struct udrm_device *udev = pipe_to_udrm(pipe);
 	struct drm_framebuffer *fb = pipe->plane.state->fb;
 	struct drm_crtc *crtc = &udev->pipe.crtc;
+	struct drm_clip_rect clips[UDRM_MAX_CLIPS];
+	unsigned int num_clips;
+
+	num_clips = udrm_plane_damage(pipe->plane.state, clips);
 
 	if (!fb)
 		DRM_DEBUG_KMS("fb unset\n");
 	else if (fb != old_state->fb)
 		DRM_DEBUG_KMS("fb changed\n");
 	else
-		DRM_DEBUG_KMS("No fb change\n");
+		DRM_DEBUG_KMS("No fb change, %u damage clips\n", num_clips);
 
-	if (fb && (fb != old_state->fb)) {
+	if (fb && (fb != old_state->fb || num_clips)) {
 		pipe->plane.fb = fb;
 
 		if (crtc->state->event) {
@@ -117,14 +184,30 @@ static void udrm_display_pipe_update(struct drm_simple_display_pipe *pipe,
 			crtc->state->event = NULL;
 		}
 
-		schedule_work(&udev->dirty_work);
+		/* Add to the damage of an update that's not flushed yet */
+		spin_lock(&udev->damage_lock);
+		if (udev->flip_pending)
+			udrm_stats_inc(udev, flushes_coalesced);
+		if (!udev->flip_pending) {
+			udev->flip_pending = true;
+			udev->num_flip_damage = num_clips;
+			memcpy(udev->flip_damage, clips, num_clips * sizeof(*clips));
+		} else if (!num_clips ||
+			   udev->num_flip_damage + num_clips > UDRM_MAX_CLIPS) {
+			udev->num_flip_damage = 0;
+		} else if (udev->num_flip_damage) {
+			memcpy(&udev->flip_damage[udev->num_flip_damage], clips,
+			       num_clips * sizeof(*clips));
+			udev->num_flip_damage += num_clips;
+		}
+		spin_unlock(&udev->damage_lock);
+
+		udrm_queue_work(udev, &udev->dirty_work);
 	}
 
 	if (crtc->state->event) {
 		DRM_DEBUG_KMS("crtc event\n");
-		spin_lock_irq(&crtc->dev->event_lock);
-		drm_crtc_send_vblank_event(crtc, crtc->state->event);
-		spin_unlock_irq(&crtc->dev->event_lock);
+		udrm_crtc_send_vblank_event(crtc, crtc->state->event);
 		crtc->state->event = NULL;
 	}
 
@@ -138,6 +221,124 @@ static const struct drm_simple_display_pipe_funcs udrm_pipe_funcs = {
 	.update = udrm_display_pipe_update,
 };
 
+static void udrm_plane_reset(struct drm_plane *plane)
+{
+	struct udrm_plane_state *state;
+
+	if (plane->state) {
+		plane->funcs->atomic_destroy_state(plane, plane->state);
+		plane->state = NULL;
+	}
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return;
+
+	state->base.plane = plane;
+	state->base.rotation = DRM_ROTATE_0;
+	plane->state = &state->base;
+}
+
+static struct drm_plane_state *
+udrm_plane_duplicate_state(struct drm_plane *plane)
+{
+	struct udrm_plane_state *state;
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return NULL;
+
+	/* Damage only applies to the commit it was set in */
+	__drm_atomic_helper_plane_duplicate_state(plane, &state->base);
+
+	return &state->base;
+}
+
+static void udrm_plane_destroy_state(struct drm_plane *plane,
+				     struct drm_plane_state *state)
+{
+	struct udrm_plane_state *ustate = to_udrm_plane_state(state);
+
+	drm_property_unreference_blob(ustate->fb_damage_clips);
+	__drm_atomic_helper_plane_destroy_state(state);
+	kfree(ustate);
+}
+
+static int udrm_plane_atomic_set_property(struct drm_plane *plane,
+					  struct drm_plane_state *state,
+					  struct drm_property *property,
+					  uint64_t val)
+{
+	struct udrm_device *udev = drm_to_udrm(plane->dev);
+	struct udrm_plane_state *ustate = to_udrm_plane_state(state);
+	struct drm_property_blob *blob = NULL;
+
+	if (property != udev->fb_damage_clips_property)
+		return -EINVAL;
+
+	if (val) {
+		blob = drm_property_lookup_blob(plane->dev, val);
+		if (!blob)
+			return -EINVAL;
+		if (blob->length % sizeof(struct udrm_damage_rect)) {
+			drm_property_unreference_blob(blob);
+			return -EINVAL;
+		}
+	}
+
+	drm_property_unreference_blob(ustate->fb_damage_clips);
+	ustate->fb_damage_clips = blob;
+
+	return 0;
+}
+
+static int udrm_plane_atomic_get_property(struct drm_plane *plane,
+					  const struct drm_plane_state *state,
+					  struct drm_property *property,
+					  uint64_t *val)
+{
+	struct udrm_device *udev = drm_to_udrm(plane->dev);
+	struct drm_property_blob *blob;
+
+	if (property != udev->fb_damage_clips_property)
+		return -EINVAL;
+
+	blob = container_of(state, struct udrm_plane_state, base)->fb_damage_clips;
+	*val = blob ? blob->base.id : 0;
+
+	return 0;
+}
+
+/* drm_simple_kms_helper's plane functions with a subclassed state */
+static const struct drm_plane_funcs udrm_plane_funcs = {
+	.update_plane		= drm_atomic_helper_update_plane,
+	.disable_plane		= drm_atomic_helper_disable_plane,
+	.destroy		= drm_plane_cleanup,
+	.reset			= udrm_plane_reset,
+	.atomic_duplicate_state	= udrm_plane_duplicate_state,
+	.atomic_destroy_state	= udrm_plane_destroy_state,
+	.atomic_set_property	= udrm_plane_atomic_set_property,
+	.atomic_get_property	= udrm_plane_atomic_get_property,
+};
+
+static int udrm_plane_init(struct udrm_device *udev)
+{
+	struct drm_plane *plane = &udev->pipe.plane;
+	struct drm_property *prop;
+
+	prop = drm_property_create(&udev->drm,
+				   DRM_MODE_PROP_ATOMIC | DRM_MODE_PROP_BLOB,
+				   "FB_DAMAGE_CLIPS", 0);
+	if (!prop)
+		return -ENOMEM;
+
+	udev->fb_damage_clips_property = prop;
+	plane->funcs = &udrm_plane_funcs;
+	drm_object_attach_property(&plane->base, prop, 0);
+
+	return 0;
+}
+
 int udrm_display_pipe_init(struct udrm_device *udev,
 			  int connector_type,
 			  const uint32_t *formats,
@@ -163,8 +364,10 @@ int udrm_display_pipe_init(struct udrm_device *udev,
 
 	ret = drm_simple_display_pipe_init(drm, &udev->pipe, &udrm_pipe_funcs,
 					   formats, format_count, connector);
-	if (ret)
+	if (ret) {
 		drm_connector_cleanup(connector);
+		return ret;
+	}
 
-	return ret;
+	return udrm_plane_init(udev);
 }
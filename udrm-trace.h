@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2016 Noralf Trønnes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM udrm
+
+#if !defined(_UDRM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UDRM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include <uapi/drm/udrm.h>
+
+#include "udrm.h"
+
+#ifndef _UDRM_TRACE_HELPERS
+#define _UDRM_TRACE_HELPERS
+
+/* DRM minor index of the device */
+static inline int udrm_trace_index(struct udrm_device *udev)
+{
+	return udev->drm.primary ? udev->drm.primary->index : -1;
+}
+
+static inline u32 udrm_trace_event_fb_id(const struct udrm_event *ev)
+{
+	switch (ev->type) {
+	case UDRM_EVENT_FB_CREATE:
+	case UDRM_EVENT_FB_DESTROY:
+		return ((const struct udrm_event_fb *)ev)->fb_id;
+	case UDRM_EVENT_FB_DIRTY:
+	case UDRM_EVENT_FB_COPY:
+	case UDRM_EVENT_FB_FILL:
+		return ((const struct udrm_event_fb_dirty *)ev)->fb_dirty_cmd.fb_id;
+	default:
+		return 0;
+	}
+}
+
+static inline u32 udrm_trace_scanout_fb_id(struct udrm_device *udev)
+{
+	return udev->pipe.plane.fb ? udev->pipe.plane.fb->base.id : 0;
+}
+
+#endif
+
+/* An event going through the queue, from send to reply */
+DECLARE_EVENT_CLASS(udrm_event,
+	TP_PROTO(struct udrm_device *udev, const struct udrm_event *ev),
+	TP_ARGS(udev, ev),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(u32, type)
+		__field(u32, seq)
+		__field(u32, fb_id)
+	),
+	TP_fast_assign(
+		__entry->index = udrm_trace_index(udev);
+		__entry->type = ev->type;
+		__entry->seq = ev->seq;
+		__entry->fb_id = udrm_trace_event_fb_id(ev);
+	),
+	TP_printk("index=%d type=%u seq=%u fb_id=%u", __entry->index,
+		  __entry->type, __entry->seq, __entry->fb_id)
+);
+
+DEFINE_EVENT(udrm_event, udrm_event_queue,
+	TP_PROTO(struct udrm_device *udev, const struct udrm_event *ev),
+	TP_ARGS(udev, ev)
+);
+
+DEFINE_EVENT(udrm_event, udrm_event_read,
+	TP_PROTO(struct udrm_device *udev, const struct udrm_event *ev),
+	TP_ARGS(udev, ev)
+);
+
+TRACE_EVENT(udrm_event_reply,
+	TP_PROTO(struct udrm_device *udev, const struct udrm_event *ev,
+		 int ret),
+	TP_ARGS(udev, ev, ret),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(u32, type)
+		__field(u32, seq)
+		__field(u32, fb_id)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->index = udrm_trace_index(udev);
+		__entry->type = ev->type;
+		__entry->seq = ev->seq;
+		__entry->fb_id = udrm_trace_event_fb_id(ev);
+		__entry->ret = ret;
+	),
+	TP_printk("index=%d type=%u seq=%u fb_id=%u ret=%d", __entry->index,
+		  __entry->type, __entry->seq, __entry->fb_id, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(udrm_fb,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id),
+	TP_ARGS(udev, fb_id),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(u32, fb_id)
+	),
+	TP_fast_assign(
+		__entry->index = udrm_trace_index(udev);
+		__entry->fb_id = fb_id;
+	),
+	TP_printk("index=%d fb_id=%u", __entry->index, __entry->fb_id)
+);
+
+DEFINE_EVENT(udrm_fb, udrm_dirty_work_begin,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id),
+	TP_ARGS(udev, fb_id)
+);
+
+DEFINE_EVENT(udrm_fb, udrm_dirty_work_end,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id),
+	TP_ARGS(udev, fb_id)
+);
+
+DEFINE_EVENT(udrm_fb, udrm_flush_work_begin,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id),
+	TP_ARGS(udev, fb_id)
+);
+
+DEFINE_EVENT(udrm_fb, udrm_flush_work_end,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id),
+	TP_ARGS(udev, fb_id)
+);
+
+DECLARE_EVENT_CLASS(udrm_conv,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id,
+		 const struct drm_clip_rect *clip),
+	TP_ARGS(udev, fb_id, clip),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(u32, fb_id)
+		__field(u16, x1)
+		__field(u16, y1)
+		__field(u16, x2)
+		__field(u16, y2)
+	),
+	TP_fast_assign(
+		__entry->index = udrm_trace_index(udev);
+		__entry->fb_id = fb_id;
+		__entry->x1 = clip->x1;
+		__entry->y1 = clip->y1;
+		__entry->x2 = clip->x2;
+		__entry->y2 = clip->y2;
+	),
+	TP_printk("index=%d fb_id=%u clip=%ux%u+%u+%u", __entry->index,
+		  __entry->fb_id, __entry->x2 - __entry->x1,
+		  __entry->y2 - __entry->y1, __entry->x1, __entry->y1)
+);
+
+DEFINE_EVENT(udrm_conv, udrm_conv_begin,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id,
+		 const struct drm_clip_rect *clip),
+	TP_ARGS(udev, fb_id, clip)
+);
+
+DEFINE_EVENT(udrm_conv, udrm_conv_end,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id,
+		 const struct drm_clip_rect *clip),
+	TP_ARGS(udev, fb_id, clip)
+);
+
+/*
+ * A page flip event reaching the DRM file. @armed: delivered by the emulated
+ * vblank, @fb_id is the framebuffer scanned out when it was armed.
+ */
+TRACE_EVENT(udrm_vblank_event,
+	TP_PROTO(struct udrm_device *udev, u32 fb_id, bool armed),
+	TP_ARGS(udev, fb_id, armed),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(u32, fb_id)
+		__field(bool, armed)
+	),
+	TP_fast_assign(
+		__entry->index = udrm_trace_index(udev);
+		__entry->fb_id = fb_id;
+		__entry->armed = armed;
+	),
+	TP_printk("index=%d fb_id=%u armed=%d", __entry->index,
+		  __entry->fb_id, __entry->armed)
+);
+
+#endif /* _UDRM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE udrm-trace
+#include <trace/define_trace.h>
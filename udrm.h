@@ -13,6 +13,75 @@
 #include <drm/drm_crtc.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_simple_kms_helper.h>
+#include <linux/hrtimer.h>
+
+#define UDRM_FBDEV_MAX_OPS	16
+#define UDRM_CONV_MAX_BANDS	8
+#define UDRM_STATS_EVENT_TYPES	8
+#define UDRM_STATS_HIST_BUCKETS	16
+
+/* Largest event sent on the flush path */
+#define UDRM_EVENT_MAX_SIZE	(sizeof(struct udrm_event_fb_dirty) + \
+				 UDRM_MAX_CLIPS * sizeof(struct drm_clip_rect))
+
+struct udrm_fbdev_op {
+	u32 type;
+	u32 color;
+	struct drm_clip_rect clips[2];
+};
+
+/* Per-CPU counters, see udrm-debugfs.c */
+struct udrm_stats {
+	u64 events[UDRM_STATS_EVENT_TYPES];
+	u64 event_ns[UDRM_STATS_EVENT_TYPES];
+	u64 event_hist[UDRM_STATS_EVENT_TYPES][UDRM_STATS_HIST_BUCKETS];
+	u64 event_timeouts;
+	u64 flushes;
+	u64 flushes_coalesced;
+	u64 flushes_dropped;
+	u64 copy_pixels;
+	u64 copy_bytes;
+	u64 copy_ns;
+	u64 copy_hist[UDRM_STATS_HIST_BUCKETS];
+};
+
+#define udrm_stats_inc(udev, field)	this_cpu_inc((udev)->stats->field)
+
+/* Imported buffers are only vmapped while they're being flushed from */
+struct udrm_gem_object {
+	struct drm_gem_cma_object base;
+	struct list_head vmap_node;
+	unsigned long vmap_used;
+	unsigned int vmap_pin;
+};
+
+struct udrm_buf {
+	struct dma_buf *dmabuf;
+	void *vaddr;
+	u32 *line;
+	s16 *err;
+	void *scratch;
+	size_t len;
+	u32 encoding;
+	u32 last_flush;
+	u32 age;
+	bool busy;
+	bool retained;
+};
+
+/* A horizontal slice of a clip converted on another CPU */
+struct udrm_conv_band {
+	struct work_struct work;
+	void *dst;
+	void *src;
+	unsigned int pitch;
+	struct drm_clip_rect clip;
+	u32 src_format;
+	u32 dst_format;
+	bool swap;
+	bool wc;
+	int ret;
+};
 
 struct udrm_device {
 	struct drm_device drm;
@@ -21,7 +90,7 @@ struct udrm_device {
 	struct drm_display_mode	display_mode;
 	struct drm_connector connector;
 	struct work_struct dirty_work;
-	struct mutex dev_lock;
+	u32 flags;
 	bool prepared;
 	bool enabled;
 
@@ -30,24 +99,98 @@ struct udrm_device {
 	struct work_struct fbdev_init_work;
 	bool fbdev_used;
 
+	struct mutex		fbdev_op_lock;
+	spinlock_t		fbdev_op_slock;
+	struct udrm_fbdev_op	fbdev_ops[UDRM_FBDEV_MAX_OPS];
+	unsigned int		num_fbdev_ops;
+	struct work_struct	fbdev_op_work;
+
 	struct drm_pending_vblank_event *event;
+	struct drm_property *fb_damage_clips_property;
+	struct drm_clip_rect flip_damage[UDRM_MAX_CLIPS];
+	unsigned int num_flip_damage;
+	bool flip_pending;
+
+	struct hrtimer		vblank_timer;
+	ktime_t			vblank_period;
+	bool			vblank_enabled;
+	/* Under event_lock, for the udrm_vblank_event tracepoint */
+	struct drm_pending_vblank_event *armed_event;
+	u32			armed_fb_id;
 
 	struct idr		idr;
 
-	struct mutex		mutex;
+	spinlock_t		ev_lock;
 	wait_queue_head_t	waitq;
-	struct completion	completion;
+	wait_queue_head_t	space_waitq;
+	struct list_head	ev_queue;
+	struct list_head	ev_sent;
+	unsigned int		ev_depth;
+	unsigned int		ev_count;
+	u32			ev_seq;
+	spinlock_t		ev_pool_lock;
+	struct list_head	ev_pool;
+	void			*ev_pool_mem;
 
-	struct udrm_event	*ev;
-	int			event_ret;
+	struct udrm_ring	*ring;
+	size_t			ring_size;
+	unsigned int		ring_entries;
+	u32			ring_sq_tail;
+	u32			ring_cq_head;
+
+	spinlock_t		damage_lock;
+	struct drm_framebuffer	*damage_fb;
+	struct drm_clip_rect	damage[UDRM_MAX_CLIPS + 1];
+	unsigned int		num_damage;
+	unsigned int		max_clips;
+	u32			clip_cost;
+	struct work_struct	flush_work;
+
+	struct mutex		tile_lock;
+	u32			*tile_hash;
+	unsigned long		*tile_valid;
+	unsigned int		tiles_x;
+	unsigned int		tiles_y;
 
 	u32 buf_mode;
-	u32 emulate_xrgb8888_format;
-	struct dma_buf *dmabuf;
-	int buf_fd;
+	u32 buf_format;
+	spinlock_t		buf_lock;
+	wait_queue_head_t	buf_waitq;
+	struct udrm_buf		bufs[UDRM_MAX_BUFS];
+	unsigned int		num_bufs;
+	size_t			buf_size;
+	u32			buf_flushes;
+
+	struct mutex		vmap_lock;
+	struct list_head	vmap_lru;
+	size_t			vmap_size;
+	size_t			vmap_max;
+	struct delayed_work	vmap_work;
+
+	struct workqueue_struct	*conv_wq;
+	struct mutex		conv_lock;
+	struct udrm_conv_band	conv_bands[UDRM_CONV_MAX_BANDS];
+	unsigned int		num_conv_bands;
+
+	struct udrm_stats __percpu *stats;
+	ktime_t			stats_reset;
+	struct dentry		*debugfs;
+
+	struct workqueue_struct	*wq;
+	int			wq_cpu;
+
+	/* UDRM_DEV_FLAG_PERSIST, see udrm-dev.c */
+	struct list_head	node;
+	struct udrm_device	*stub;
+	struct work_struct	attach_work;
+	bool			detached;
 
+	/* The userspace driver and the open DRM files */
+	atomic_t		users;
+	bool			torn_down;
+
+	bool			drm_initialized;
 	bool			initialized;
-	struct work_struct	release_work;
 };
 
 static inline struct udrm_device *
@@ -62,12 +205,46 @@ pipe_to_udrm(struct drm_simple_display_pipe *pipe)
 	return container_of(pipe, struct udrm_device, pipe);
 }
 
+/* Bits per pixel of the grayscale buffer modes, zero for the others */
+static inline unsigned int udrm_buf_gray_bpp(u32 buf_mode)
+{
+	switch (buf_mode & UDRM_BUF_MODE_MASK) {
+	case UDRM_BUF_MODE_GRAY8:
+		return 8;
+	case UDRM_BUF_MODE_GRAY4:
+		return 4;
+	case UDRM_BUF_MODE_GRAY2:
+		return 2;
+	case UDRM_BUF_MODE_MONO:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 int udrm_send_event(struct udrm_device *udev, void *ev_in);
+int udrm_send_event_reply(struct udrm_device *udev, void *ev_in,
+			  struct udrm_event_reply *reply);
+int udrm_send_event_dmabuf(struct udrm_device *udev, void *ev_in,
+			   struct dma_buf *dmabuf);
 
 int udrm_drm_register(struct udrm_device *udev,
 		      struct udrm_dev_create *dev_create,
 		      uint32_t *formats, unsigned int num_formats);
 void udrm_drm_unregister(struct udrm_device *udev);
+void udrm_drm_detach(struct udrm_device *udev);
+void udrm_queue_work(struct udrm_device *udev, struct work_struct *work);
+struct udrm_buf *udrm_buf_acquire(struct udrm_device *udev);
+void udrm_buf_done(struct udrm_device *udev, struct udrm_buf *buf,
+		   bool retain);
+int udrm_buf_release(struct udrm_device *udev, unsigned int index);
+bool udrm_buf_available(struct udrm_device *udev);
+int udrm_gem_vmap_get(struct udrm_device *udev,
+		      struct drm_gem_cma_object *cma_obj);
+void udrm_gem_vmap_put(struct udrm_device *udev,
+		       struct drm_gem_cma_object *cma_obj);
+void udrm_crtc_send_vblank_event(struct drm_crtc *crtc,
+				 struct drm_pending_vblank_event *event);
 
 int
 udrm_display_pipe_init(struct udrm_device *tdev,
@@ -75,10 +252,57 @@ udrm_display_pipe_init(struct udrm_device *tdev,
 			  const uint32_t *formats,
 			  unsigned int format_count);
 
+u64 udrm_clip_area(const struct drm_clip_rect *clip);
+void udrm_clip_union(struct drm_clip_rect *dst,
+		     const struct drm_clip_rect *src);
+bool udrm_clip_valid(const struct drm_clip_rect *clip,
+		     u32 max_width, u32 max_height);
+bool udrm_clip_same_size(const struct drm_clip_rect *a,
+			 const struct drm_clip_rect *b);
+void udrm_clip_add(struct drm_clip_rect *clips, unsigned int *num_clips,
+		   unsigned int max_clips, u32 clip_cost,
+		   const struct drm_clip_rect *clip);
+unsigned int udrm_merge_clips(struct drm_clip_rect *dst,
+			      unsigned int max_clips, u32 clip_cost,
+			      struct drm_clip_rect *src,
+			      unsigned int num_clips, unsigned int flags,
+			      u32 max_width, u32 max_height);
+
+void udrm_conv_init(void);
+bool udrm_conv_supported(u32 src_format, u32 dst_format);
+int udrm_conv_clip(void *dst, void *vaddr, unsigned int pitch,
+		   const struct drm_clip_rect *clip, u32 src_format,
+		   u32 dst_format, bool swap, bool wc);
+int udrm_conv_clip_gray(void *dst, void *vaddr, unsigned int pitch,
+			const struct drm_clip_rect *clip, u32 src_format,
+			unsigned int bpp, u32 dither, u32 *line, s16 *err);
+size_t udrm_conv_rle(void *dst, size_t dst_len, const void *src,
+		     size_t src_len, unsigned int cpp);
+void udrm_conv_row_delta(void *vaddr, size_t pitch, unsigned int rows,
+			 bool undo);
+
+int udrm_fb_flush(struct drm_framebuffer *fb, unsigned int flags,
+		  unsigned int color, struct drm_clip_rect *clips,
+		  unsigned int num_clips, ktime_t *timestamp);
+void udrm_fb_flush_work(struct work_struct *work);
+void udrm_fb_flush_cancel(struct udrm_device *udev);
+void udrm_fbdev_op_work(struct work_struct *work);
+int udrm_fb_tile_hash_init(struct udrm_device *udev);
+void udrm_fb_tile_hash_fini(struct udrm_device *udev);
+int udrm_fb_conv_init(struct udrm_device *udev);
+void udrm_fb_conv_fini(struct udrm_device *udev);
 struct drm_framebuffer *
 udrm_fb_create(struct drm_device *drm, struct drm_file *file_priv,
 		  const struct drm_mode_fb_cmd2 *mode_cmd);
 int udrm_fbdev_init(struct udrm_device *tdev);
 void udrm_fbdev_fini(struct udrm_device *tdev);
+int udrm_fb_replay(struct udrm_device *udev);
+
+int udrm_stats_init(struct udrm_device *udev);
+void udrm_stats_fini(struct udrm_device *udev);
+void udrm_stats_event(struct udrm_device *udev, u32 type, u64 ns);
+void udrm_stats_copy(struct udrm_device *udev, u64 pixels, u64 bytes, u64 ns);
+int udrm_debugfs_init(struct drm_minor *minor);
+void udrm_debugfs_cleanup(struct drm_minor *minor);
 
 #endif /* __LINUX_TINYDRM_H */